@@ -0,0 +1,148 @@
+/*
+*  Copyright 2019 Federico Viglietta
+*
+*  This is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "tmsg.h"
+
+// Compares the client library with raw syscalls on an unused device file
+// Execute after sudoing in your shell
+
+#define MSG_SIZE 64
+#define BATCH 32
+#define ITERS_DEFAULT 100000
+
+static char payload[MSG_SIZE];
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double start, unsigned long msgs)
+{
+	printf("%-24s %8.1f ns/msg\n", name, (now_ns() - start) / msgs);
+}
+
+static void fail(const char *what, int err)
+{
+	fprintf(stderr, "%s failed: %s\n", what, strerror(err));
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, ret;
+	unsigned long i, j, iters;
+	double start;
+	char buf[MSG_SIZE];
+	struct iovec iov[BATCH];
+	struct tmsg_session *t;
+	struct tmsg_pool pool;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: sudo %s <pathname> [iterations]\n",
+			argv[0]);
+		return(EXIT_FAILURE);
+	}
+	iters = argc > 2 ? strtoul(argv[2], NULL, 0) : ITERS_DEFAULT;
+	for (i = 0; i < BATCH; i++) {
+		iov[i].iov_base = payload;
+		iov[i].iov_len = MSG_SIZE;
+	}
+
+	// Raw syscalls, non-blocking reads
+	fd = open(argv[1], O_RDWR);
+	if (fd == -1) {
+		fail("open()", errno);
+	}
+	ioctl(fd, SET_RECV_TIMEOUT, 0);
+	start = now_ns();
+	for (i = 0; i < iters; i++) {
+		if (write(fd, payload, MSG_SIZE) == -1) {
+			fail("write()", errno);
+		}
+		if (read(fd, buf, MSG_SIZE) == -1) {
+			fail("read()", errno);
+		}
+	}
+	report("raw write+read", start, iters);
+	start = now_ns();
+	for (i = 0; i < iters / BATCH; i++) {
+		for (j = 0; j < BATCH; j++) {
+			if (write(fd, payload, MSG_SIZE) == -1) {
+				fail("write()", errno);
+			}
+		}
+		for (j = 0; j < BATCH; j++) {
+			if (read(fd, buf, MSG_SIZE) == -1) {
+				fail("read()", errno);
+			}
+		}
+	}
+	report("raw batch of 32", start, iters / BATCH * BATCH);
+	close(fd);
+
+	// Client library
+	ret = tmsg_open(&t, argv[1], NULL);
+	if (ret < 0) {
+		fail("tmsg_open()", -ret);
+	}
+	ret = tmsg_pool_create(t, BATCH, &pool);
+	if (ret < 0) {
+		fail("tmsg_pool_create()", -ret);
+	}
+	start = now_ns();
+	for (i = 0; i < iters; i++) {
+		ret = tmsg_send(t, payload, MSG_SIZE);
+		if (ret < 0) {
+			fail("tmsg_send()", -ret);
+		}
+		ret = tmsg_recv(t, &(pool.bufs[0]), 0);
+		if (ret < 0) {
+			fail("tmsg_recv()", -ret);
+		}
+	}
+	report("tmsg send+recv", start, iters);
+	start = now_ns();
+	for (i = 0; i < iters / BATCH; i++) {
+		ret = tmsg_send_batch(t, iov, BATCH);
+		if (ret < 0) {
+			fail("tmsg_send_batch()", -ret);
+		}
+		for (j = 0; j < BATCH; j += ret) {
+			ret = tmsg_recv_batch(t, pool.bufs, BATCH - j, 0);
+			if (ret < 0) {
+				fail("tmsg_recv_batch()", -ret);
+			}
+		}
+	}
+	report("tmsg batch of 32", start, iters / BATCH * BATCH);
+	tmsg_pool_destroy(&pool);
+	tmsg_close(t);
+
+	return(EXIT_SUCCESS);
+}
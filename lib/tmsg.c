@@ -0,0 +1,406 @@
+/*
+*  Copyright 2019 Federico Viglietta
+*
+*  This is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "tmsg.h"
+
+#define MAX_MSG_SIZE_PATH "/sys/module/timed_msg_system/parameters/max_message_size"
+#define MAX_STORAGE_SIZE_PATH "/sys/module/timed_msg_system/parameters/max_storage_size"
+/* A receive that never expires blocks in the driver for this long at once */
+#define FOREVER_SLICE 3600000   /* milliseconds */
+#define BUF_ALIGN 64            /* Buffers do not share cache lines */
+#define HUGE_SLAB (2UL << 20)   /* Slabs worth a transparent huge page */
+
+/**
+* tmsg_session - I/O session of the client library
+*/
+struct tmsg_session {
+	int fd;
+	unsigned int flags;
+	unsigned int max_msg_size;
+	unsigned int max_storage_size; /* Bound of the corked batches */
+	long read_timeout;        /* Last SET_RECV_TIMEOUT, -1 if unknown */
+	int can_cork;             /* Cleared if the driver has no CORK */
+};
+
+/**
+* __module_param - Read a size parameter of the driver
+*
+* @path: path of the parameter under /sys/module
+* @def: value if the parameter is not readable
+*
+* Returns the parameter, or @def
+*/
+static unsigned int __module_param(const char *path, unsigned int def)
+{
+	FILE *f;
+	unsigned int size;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return def;
+	}
+	if (fscanf(f, "%u", &size) != 1 || size == 0) {
+		size = def;
+	}
+	fclose(f);
+	return size;
+}
+
+/**
+* __set_read_timeout - Set the read timeout of the session, if it changed
+*
+* @t: pointer to the %tmsg_session
+* @timeout: milliseconds
+*
+* Returns 0 or a negative error code
+*/
+static int __set_read_timeout(struct tmsg_session *t, long timeout)
+{
+	if (t->read_timeout == timeout) {
+		return 0;
+	}
+	if (ioctl(t->fd, SET_RECV_TIMEOUT, timeout) == -1) {
+		t->read_timeout = -1;
+		return -errno;
+	}
+	t->read_timeout = timeout;
+	return 0;
+}
+
+int tmsg_open(struct tmsg_session **out, const char *path,
+	      const struct tmsg_opts *opts)
+{
+	int ret;
+	struct tmsg_session *t;
+	struct tmsg_opts defaults = { 0 };
+
+	if (opts == NULL) {
+		opts = &defaults;
+	}
+	t = malloc(sizeof(struct tmsg_session));
+	if (t == NULL) {
+		return -ENOMEM;
+	}
+	t->flags = opts->flags;
+	t->max_msg_size = opts->max_msg_size ? opts->max_msg_size :
+	    __module_param(MAX_MSG_SIZE_PATH, TMSG_MAX_MSG_SIZE_DEFAULT);
+	t->max_storage_size = __module_param(MAX_STORAGE_SIZE_PATH,
+					     TMSG_MAX_STORAGE_SIZE_DEFAULT);
+	t->read_timeout = -1;
+	t->can_cork = !(opts->flags & TMSG_NO_CORK);
+	t->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (t->fd == -1) {
+		ret = -errno;
+		free(t);
+		return ret;
+	}
+	ret = __set_read_timeout(t, 0);
+	if (!ret && (t->flags & TMSG_HEADERS)
+	    && ioctl(t->fd, SET_READ_HEADER, 1) == -1) {
+		ret = -errno;
+	}
+	if (!ret && (t->flags & TMSG_STRICT)
+	    && ioctl(t->fd, SET_STRICT_READ, 1) == -1) {
+		ret = -errno;
+	}
+	if (!ret && opts->busy_poll_us
+	    && ioctl(t->fd, SET_BUSY_POLL_US, opts->busy_poll_us) == -1) {
+		ret = -errno;
+	}
+	if (!ret && opts->write_timeout
+	    && ioctl(t->fd, SET_SEND_TIMEOUT, opts->write_timeout) == -1) {
+		ret = -errno;
+	}
+	if (ret) {
+		close(t->fd);
+		free(t);
+		return ret;
+	}
+	*out = t;
+	return 0;
+}
+
+void tmsg_close(struct tmsg_session *t)
+{
+	close(t->fd);
+	free(t);
+}
+
+int tmsg_fd(const struct tmsg_session *t)
+{
+	return t->fd;
+}
+
+int tmsg_set_eventfd(struct tmsg_session *t, int efd)
+{
+	if (ioctl(t->fd, REGISTER_EVENTFD, efd) == -1) {
+		return -errno;
+	}
+	return 0;
+}
+
+int tmsg_send(struct tmsg_session *t, const void *buf, size_t len)
+{
+	if (write(t->fd, buf, len) == -1) {
+		return -errno;
+	}
+	return 0;
+}
+
+/**
+* __uncork - Publish the batch staged by a session, corking it again
+*
+* @t: pointer to the %tmsg_session
+* @recork: set to stage the following writes
+*
+* Returns the number of stored messages or a negative error code
+*/
+static int __uncork(struct tmsg_session *t, int recork)
+{
+	int ret;
+	struct cork_struct cork = { 0 };
+
+	ret = ioctl(t->fd, UNCORK);
+	if (ret == -1) {
+		return -errno;
+	}
+	if (recork && ioctl(t->fd, CORK, &cork) == -1) {
+		return -errno;
+	}
+	return ret;
+}
+
+int tmsg_send_batch(struct tmsg_session *t, const struct iovec *msgs,
+		    unsigned int nr)
+{
+	int ret = 0;
+	int err;
+	int big;
+	int stored = 0;
+	unsigned int i;
+	size_t len;
+	size_t staged = 0;
+	struct cork_struct cork = { 0 };
+
+	if (nr > 1 && t->can_cork) {
+		if (ioctl(t->fd, CORK, &cork) == 0) {
+			goto corked;
+		} else if (errno == ENOTTY || errno == EINVAL) {
+			t->can_cork = 0;
+		} else {
+			return -errno;
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		ret = tmsg_send(t, msgs[i].iov_base, msgs[i].iov_len);
+		if (ret < 0) {
+			break;
+		}
+	}
+	return i ? (int)i : ret;
+
+ corked:
+	for (i = 0; i < nr; i++) {
+		len = msgs[i].iov_len;
+		big = len >= t->max_storage_size;
+		/*
+		 * Publish before the bytes bound of the driver would, so that
+		 * the stored messages of every part are known. A message that
+		 * reaches the bound alone is written uncorked
+		 */
+		if (big || (staged && staged + len >= t->max_storage_size)) {
+			err = __uncork(t, !big);
+			if (err < 0) {
+				return stored ? stored : err;
+			}
+			stored += err;
+			staged = 0;
+		}
+		ret = tmsg_send(t, msgs[i].iov_base, len);
+		if (big) {
+			if (ret == 0) {
+				stored++;
+			}
+			if (ioctl(t->fd, CORK, &cork) == -1) {
+				err = -errno;
+				return stored ? stored : (ret ? ret : err);
+			}
+		}
+		if (ret < 0) {
+			break;
+		}
+		if (!big) {
+			staged += len;
+		}
+	}
+	/* Publish what was staged, even if a write failed */
+	err = __uncork(t, 0);
+	if (err < 0) {
+		return stored ? stored : err;
+	}
+	stored += err;
+	return stored ? stored : ret;
+}
+
+int tmsg_pool_create(const struct tmsg_session *t, unsigned int nr,
+		     struct tmsg_pool *pool)
+{
+	unsigned int i;
+	size_t size, stride;
+	long page_size;
+
+	size = t->max_msg_size;
+	if (t->flags & TMSG_HEADERS) {
+		size += sizeof(struct read_header_struct);
+	}
+	stride = (size + BUF_ALIGN - 1) & ~(size_t)(BUF_ALIGN - 1);
+	page_size = sysconf(_SC_PAGESIZE);
+	pool->slab_len = (stride * nr + page_size - 1) &
+	    ~(size_t)(page_size - 1);
+	pool->bufs = calloc(nr, sizeof(struct tmsg_buf));
+	if (pool->bufs == NULL) {
+		return -ENOMEM;
+	}
+	pool->slab = mmap(NULL, pool->slab_len, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (pool->slab == MAP_FAILED) {
+		free(pool->bufs);
+		return -ENOMEM;
+	}
+	if (pool->slab_len >= HUGE_SLAB) {
+		madvise(pool->slab, pool->slab_len, MADV_HUGEPAGE);
+	}
+	pool->nr = nr;
+	for (i = 0; i < nr; i++) {
+		pool->bufs[i].base = (char *)pool->slab + i * stride;
+		pool->bufs[i].size = size;
+	}
+	return 0;
+}
+
+void tmsg_pool_destroy(struct tmsg_pool *pool)
+{
+	munmap(pool->slab, pool->slab_len);
+	free(pool->bufs);
+}
+
+/**
+* __read - Read a message into a buffer with the current read timeout
+*
+* @t: pointer to the %tmsg_session
+* @buf: pointer to the %tmsg_buf receiving the message
+*
+* Returns the payload length or the negative error code of read()
+*/
+static int __read(struct tmsg_session *t, struct tmsg_buf *buf)
+{
+	ssize_t ret;
+
+	ret = read(t->fd, buf->base, buf->size);
+	if (ret == -1) {
+		return -errno;
+	}
+	if (!(t->flags & TMSG_HEADERS)) {
+		buf->data = buf->base;
+		buf->len = ret;
+		buf->truncated = 0;
+		buf->hdr = NULL;
+		return ret;
+	}
+	buf->hdr = (const struct read_header_struct *)buf->base;
+	buf->data = buf->base + sizeof(struct read_header_struct);
+	buf->len = ret - sizeof(struct read_header_struct);
+	buf->truncated = buf->hdr->size > buf->len;
+	return buf->len;
+}
+
+int tmsg_recv(struct tmsg_session *t, struct tmsg_buf *buf, int timeout)
+{
+	int ret;
+	struct pollfd pfd = { .fd = t->fd, .events = POLLIN };
+
+	if (timeout == TMSG_FOREVER) {
+		ret = __set_read_timeout(t, FOREVER_SLICE);
+		while (!ret && (ret = __read(t, buf)) == -ETIME) ;
+		return ret;
+	}
+	ret = __set_read_timeout(t, timeout);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = __read(t, buf);
+	/*
+	 * Timeouts shorter than a tick become non-blocking reads in the
+	 * driver (-ENOMSG rather than -ETIME), so poll() waits for them
+	 */
+	if (ret == -ENOMSG && timeout > 0 && poll(&pfd, 1, timeout) > 0) {
+		ret = __set_read_timeout(t, 0);
+		if (!ret) {
+			ret = __read(t, buf);
+		}
+	}
+	if (ret == -ENOMSG || ret == -ETIME) {
+		return -EAGAIN;
+	}
+	return ret;
+}
+
+int tmsg_peek_size(struct tmsg_session *t)
+{
+	int ret;
+
+	ret = ioctl(t->fd, PEEK_SIZE);
+	if (ret == -1) {
+		return errno == ENOMSG ? -EAGAIN : -errno;
+	}
+	return ret;
+}
+
+int tmsg_recv_batch(struct tmsg_session *t, struct tmsg_buf *bufs,
+		    unsigned int nr, int timeout)
+{
+	int ret;
+	unsigned int i;
+
+	if (nr == 0) {
+		return 0;
+	}
+	ret = tmsg_recv(t, &(bufs[0]), timeout);
+	if (ret < 0) {
+		return ret;
+	}
+	if (nr > 1 && __set_read_timeout(t, 0) < 0) {
+		return 1;
+	}
+	/* The first error is reported by the next call */
+	for (i = 1; i < nr; i++) {
+		if (__read(t, &(bufs[i])) < 0) {
+			break;
+		}
+	}
+	return i;
+}
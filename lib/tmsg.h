@@ -0,0 +1,187 @@
+/*
+*  Copyright 2019 Federico Viglietta
+*
+*  This is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TMSG_H
+#define TMSG_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "../timed-msg-system.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*********************************Session options*******************************/
+
+#define TMSG_HEADERS 0x1        /* Receive the read header (SET_READ_HEADER) */
+#define TMSG_NO_CORK 0x2        /* Do not cork batched sends */
+#define TMSG_STRICT 0x4         /* Short buffers fail, see SET_STRICT_READ */
+
+#define TMSG_FOREVER -1         /* Timeout of a receive that never expires */
+#define TMSG_MAX_MSG_SIZE_DEFAULT 4096 /* If max_message_size is unreadable */
+#define TMSG_MAX_STORAGE_SIZE_DEFAULT 65536 /* If max_storage_size is too */
+
+/**
+* tmsg_opts - Options of a session, all zeroes are the defaults
+*/
+struct tmsg_opts {
+	unsigned int flags;       /* TMSG_* */
+	unsigned int max_msg_size; /* 0 reads max_message_size from /sys */
+	unsigned int busy_poll_us; /* SET_BUSY_POLL_US, 0 to disable */
+	unsigned int write_timeout; /* SET_SEND_TIMEOUT, milliseconds */
+};
+
+/**
+* tmsg_buf - A receive buffer of a pool
+*
+* The driver writes at base, the payload starts at data
+*/
+struct tmsg_buf {
+	char *base;
+	size_t size;              /* Bytes available at base */
+	void *data;               /* Payload of the last received message */
+	size_t len;               /* Payload bytes */
+	int truncated;            /* Set if the payload did not fit (the rest of
+				     the message is lost), TMSG_HEADERS only */
+	const struct read_header_struct *hdr; /* NULL without TMSG_HEADERS */
+};
+
+/**
+* tmsg_pool - Receive buffers carved out of one prefaulted mapping
+*/
+struct tmsg_pool {
+	struct tmsg_buf *bufs;
+	unsigned int nr;
+	void *slab;
+	size_t slab_len;
+};
+
+struct tmsg_session;
+
+/**
+* tmsg_open - Open an I/O session on a device file
+*
+* @out: where the session is stored
+* @path: pathname of the device file
+* @opts: options of the session, NULL for the defaults
+*
+* Returns 0 on success or a negative error code
+*/
+int tmsg_open(struct tmsg_session **out, const char *path,
+	      const struct tmsg_opts *opts);
+
+/**
+* tmsg_close - Close a session, revoking its delayed messages (see flush())
+*/
+void tmsg_close(struct tmsg_session *t);
+
+/**
+* tmsg_fd - File descriptor of a session, to be polled for POLLIN
+*/
+int tmsg_fd(const struct tmsg_session *t);
+
+/**
+* tmsg_set_eventfd - Signal an eventfd when messages are posted
+*
+* @efd: eventfd file descriptor, -1 to stop signaling
+*
+* Returns 0 on success or a negative error code
+*/
+int tmsg_set_eventfd(struct tmsg_session *t, int efd);
+
+/**
+* tmsg_send - Post a message
+*
+* Returns 0 on success (the post of a delayed write may still fail), or a
+* negative error code: -EMSGSIZE, -ENOSPC, -EAGAIN (rate limit)
+*/
+int tmsg_send(struct tmsg_session *t, const void *buf, size_t len);
+
+/**
+* tmsg_send_batch - Post a batch of messages
+*
+* @msgs: one iovec per message
+* @nr: number of messages
+*
+* Returns the number of stored messages, or a negative error code if none
+* is stored
+*
+* NOTE The batch is corked, so that it is published under a single hold of
+* the device file mutex with one wake up. Batches larger than
+* max_storage_size are split. With the OVERFLOW_REJECT policy a part that
+* does not fit is not posted at all, and messages discarded by the overflow
+* policy are not counted. Without CORK in the driver, the written messages
+* are counted
+*/
+int tmsg_send_batch(struct tmsg_session *t, const struct iovec *msgs,
+		    unsigned int nr);
+
+/**
+* tmsg_pool_create - Allocate receive buffers sized for the session
+*
+* @nr: number of buffers
+*
+* Returns 0 on success or a negative error code
+*
+* NOTE The buffers are mapped and prefaulted, so that the driver never takes
+* a page fault while copying a message
+*/
+int tmsg_pool_create(const struct tmsg_session *t, unsigned int nr,
+		     struct tmsg_pool *pool);
+
+void tmsg_pool_destroy(struct tmsg_pool *pool);
+
+/**
+* tmsg_recv - Receive a message
+*
+* @buf: buffer receiving the message
+* @timeout: milliseconds, 0 does not block, TMSG_FOREVER never expires
+*
+* Returns the payload length, or -EAGAIN if no message arrived in time,
+* -ECANCELED if the device file was flushed, -EMSGSIZE if the buffer is short
+* with TMSG_STRICT (the message stays queued), or another negative error code
+*/
+int tmsg_recv(struct tmsg_session *t, struct tmsg_buf *buf, int timeout);
+
+/**
+* tmsg_peek_size - Size of the next message, without removing it
+*
+* Returns the payload size, -EAGAIN if no message is available, or another
+* negative error code
+*
+* NOTE With TMSG_HEADERS, a buffer must also hold the read header
+*/
+int tmsg_peek_size(struct tmsg_session *t);
+
+/**
+* tmsg_recv_batch - Receive up to @nr messages
+*
+* Waits up to @timeout for the first message, then takes the messages
+* already available without blocking
+*
+* Returns the number of received messages or a negative error code, as
+* tmsg_recv()
+*/
+int tmsg_recv_batch(struct tmsg_session *t, struct tmsg_buf *bufs,
+		    unsigned int nr, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,272 @@
+/*
+*  Copyright 2019 Federico Viglietta
+*
+*  This is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* C++20 bindings of the client library. Receives can be awaited from
+* coroutines, resumed by a reactor built on epoll:
+*
+*	tmsg::task consume(tmsg::reactor &r, tmsg::session &s, tmsg::pool &p)
+*	{
+*		for (;;) {
+*			int nr = co_await s.async_recv(r, p.bufs());
+*			...
+*		}
+*	}
+*
+*	consume(r, s, p);
+*	r.run();
+*/
+
+#ifndef TMSG_HPP
+#define TMSG_HPP
+
+#include <cerrno>
+#include <coroutine>
+#include <exception>
+#include <span>
+#include <system_error>
+#include <utility>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "tmsg.h"
+
+namespace tmsg {
+
+class reactor;
+
+/**
+* task - Return type of fire-and-forget coroutines, started on call
+*/
+struct task {
+	struct promise_type {
+		task get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+/**
+* recv_awaitable - A batched receive awaited by a coroutine
+*
+* The receive is first tried without blocking. If no message is available,
+* the coroutine is suspended until the reactor sees the session readable
+* and a new attempt gets at least one message, or an error
+*/
+class recv_awaitable {
+public:
+	recv_awaitable(reactor &r, struct tmsg_session *t,
+		       std::span<tmsg_buf> bufs)
+	    : r_(r), t_(t), bufs_(bufs) {}
+
+	bool await_ready() noexcept { return try_recv(); }
+	void await_suspend(std::coroutine_handle<> handle);
+	int await_resume() const noexcept { return result_; }
+
+private:
+	friend class reactor;
+
+	bool try_recv() noexcept
+	{
+		result_ = tmsg_recv_batch(t_, bufs_.data(), bufs_.size(), 0);
+		return result_ != -EAGAIN;
+	}
+
+	reactor &r_;
+	struct tmsg_session *t_;
+	std::span<tmsg_buf> bufs_;
+	std::coroutine_handle<> handle_;
+	int result_ = 0;
+};
+
+/**
+* reactor - Resumes the coroutines waiting for messages
+*
+* NOTE A session can be awaited by one coroutine at a time. Sessions are
+* registered with EPOLLONESHOT and armed again by each wait
+*/
+class reactor {
+public:
+	reactor() : epfd_(epoll_create1(EPOLL_CLOEXEC))
+	{
+		if (epfd_ == -1) {
+			throw std::system_error(errno, std::generic_category(),
+						"epoll_create1");
+		}
+	}
+	~reactor() { close(epfd_); }
+	reactor(const reactor &) = delete;
+	reactor &operator=(const reactor &) = delete;
+
+	/* Number of suspended receives */
+	unsigned int pending() const noexcept { return pending_; }
+
+	/* Resume the receives completed within timeout milliseconds */
+	void run_once(int timeout = -1)
+	{
+		struct epoll_event events[64];
+		recv_awaitable *a;
+		int i, nr;
+
+		nr = epoll_wait(epfd_, events, 64, timeout);
+		if (nr == -1 && errno != EINTR) {
+			throw std::system_error(errno, std::generic_category(),
+						"epoll_wait");
+		}
+		for (i = 0; i < nr; i++) {
+			a = static_cast<recv_awaitable *>(events[i].data.ptr);
+			if (!a->try_recv()) {
+				arm(a);
+				continue;
+			}
+			pending_--;
+			a->handle_.resume();
+		}
+	}
+
+	/* Run until no receive is suspended */
+	void run()
+	{
+		while (pending_) {
+			run_once();
+		}
+	}
+
+private:
+	friend class recv_awaitable;
+
+	void arm(recv_awaitable *a)
+	{
+		struct epoll_event ev = {};
+		int fd = tmsg_fd(a->t_);
+
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = a;
+		if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) == -1
+		    && (errno != ENOENT
+			|| epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == -1)) {
+			throw std::system_error(errno, std::generic_category(),
+						"epoll_ctl");
+		}
+	}
+
+	int epfd_;
+	unsigned int pending_ = 0;
+};
+
+inline void recv_awaitable::await_suspend(std::coroutine_handle<> handle)
+{
+	handle_ = handle;
+	r_.arm(this);
+	r_.pending_++;
+}
+
+/**
+* pool - Owner of a %tmsg_pool
+*/
+class pool {
+public:
+	pool(const struct tmsg_session *t, unsigned int nr)
+	{
+		int ret = tmsg_pool_create(t, nr, &p_);
+
+		if (ret < 0) {
+			throw std::system_error(-ret, std::generic_category(),
+						"tmsg_pool_create");
+		}
+	}
+	~pool() { tmsg_pool_destroy(&p_); }
+	pool(const pool &) = delete;
+	pool &operator=(const pool &) = delete;
+
+	std::span<tmsg_buf> bufs() noexcept { return { p_.bufs, p_.nr }; }
+	tmsg_buf &operator[](unsigned int i) noexcept { return p_.bufs[i]; }
+	unsigned int size() const noexcept { return p_.nr; }
+
+private:
+	struct tmsg_pool p_;
+};
+
+/**
+* session - Owner of a %tmsg_session, errors are negative codes as in C
+*/
+class session {
+public:
+	explicit session(const char *path, const tmsg_opts *opts = nullptr)
+	{
+		int ret = tmsg_open(&t_, path, opts);
+
+		if (ret < 0) {
+			throw std::system_error(-ret, std::generic_category(),
+						"tmsg_open");
+		}
+	}
+	~session()
+	{
+		if (t_ != nullptr) {
+			tmsg_close(t_);
+		}
+	}
+	session(session &&other) noexcept
+	    : t_(std::exchange(other.t_, nullptr)) {}
+	session &operator=(session &&other) noexcept
+	{
+		std::swap(t_, other.t_);
+		return *this;
+	}
+	session(const session &) = delete;
+	session &operator=(const session &) = delete;
+
+	int fd() const noexcept { return tmsg_fd(t_); }
+	struct tmsg_session *native() noexcept { return t_; }
+
+	int send(const void *buf, size_t len) noexcept
+	{
+		return tmsg_send(t_, buf, len);
+	}
+	int send_batch(std::span<const struct iovec> msgs) noexcept
+	{
+		return tmsg_send_batch(t_, msgs.data(), msgs.size());
+	}
+	int recv(tmsg_buf &buf, int timeout = TMSG_FOREVER) noexcept
+	{
+		return tmsg_recv(t_, &buf, timeout);
+	}
+	int recv_batch(std::span<tmsg_buf> bufs,
+		       int timeout = TMSG_FOREVER) noexcept
+	{
+		return tmsg_recv_batch(t_, bufs.data(), bufs.size(), timeout);
+	}
+
+	/* Awaitable receive of up to bufs.size() messages */
+	recv_awaitable async_recv(reactor &r, std::span<tmsg_buf> bufs) noexcept
+	{
+		return recv_awaitable(r, t_, bufs);
+	}
+	recv_awaitable async_recv(reactor &r, tmsg_buf &buf) noexcept
+	{
+		return recv_awaitable(r, t_, std::span<tmsg_buf>(&buf, 1));
+	}
+
+private:
+	struct tmsg_session *t_ = nullptr;
+};
+
+}
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../timed-msg-system.h"
+
+// Compile with -lpthread
+// Execute after sudoing in your shell
+// Requests are posted to minor 0, replies to minor 1
+
+#define REQUEST_MINOR 0
+#define REPLY_MINOR 1
+#define CALLERS 4
+#define CALLS 100
+#define BUF_SIZE 128
+#define CALL_TIMEOUT 1000
+
+int request_fd, reply_fd;
+
+struct reply_msg {
+	struct write_header_struct header;
+	char payload[BUF_SIZE];
+};
+
+void *server(void *arg)
+{
+	int ret, len;
+	char buf[sizeof(struct read_header_struct) + BUF_SIZE];
+	struct read_header_struct *header = (struct read_header_struct *)buf;
+	struct reply_msg reply;
+
+	// Echo every request back, tagged with its correlation ID
+	memset(&reply, 0, sizeof(reply));
+	reply.header.flags = WRITE_HEADER_REPLY;
+	while (1) {
+		ret = read(request_fd, buf, sizeof(buf) - 1);
+		if (ret == -1) {
+			continue;	// read timeout
+		}
+		buf[ret] = '\0';
+		reply.header.corr_id = header->corr_id;
+		len = snprintf(reply.payload, BUF_SIZE, "re: %s",
+			       buf + sizeof(struct read_header_struct));
+		if (write(reply_fd, &reply, sizeof(reply.header) + len) == -1) {
+			fprintf(stderr, "write() failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	return NULL;
+}
+
+void *caller(void *arg)
+{
+	int i, ret, fd;
+	char request[BUF_SIZE];
+	char reply[BUF_SIZE];
+	char expected[BUF_SIZE];
+	struct call_struct call;
+
+	// Each caller has its own session on the request minor
+	fd = open((char *)arg, O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "open() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < CALLS; i++) {
+		snprintf(request, BUF_SIZE, "%lu-%d", pthread_self(), i);
+		memset(&call, 0, sizeof(call));
+		call.request = (__u64)(uintptr_t)request;
+		call.request_len = strlen(request) + 1;
+		call.reply = (__u64)(uintptr_t)reply;
+		call.reply_len = BUF_SIZE;
+		call.reply_minor = REPLY_MINOR;
+		call.timeout = CALL_TIMEOUT;
+		ret = ioctl(fd, CALL, &call);
+		if (ret == -1) {
+			fprintf(stderr, "CALL failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		snprintf(expected, BUF_SIZE, "re: %s", request);
+		if (strcmp(reply, expected)) {
+			fprintf(stderr, "unexpected reply %s to %s\n", reply,
+				request);
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int major;
+	int i, ret;
+	pthread_t server_tid, caller_tids[CALLERS];
+
+	if (argc != 4) {
+		fprintf(stderr,
+			"Usage:sudo %s <request pathname> <reply pathname> <major>\n",
+			argv[0]);
+		return(EXIT_FAILURE);
+	}
+
+	major = strtoul(argv[3], NULL, 0);
+
+	// Create the two char device files
+	ret = mknod(argv[1], S_IFCHR, makedev(major, REQUEST_MINOR));
+	if (ret == -1) {
+		fprintf(stderr, "mknod() failed\n");
+		return(EXIT_FAILURE);
+	}
+	ret = mknod(argv[2], S_IFCHR, makedev(major, REPLY_MINOR));
+	if (ret == -1) {
+		fprintf(stderr, "mknod() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	request_fd = open(argv[1], O_RDWR);
+	reply_fd = open(argv[2], O_RDWR);
+	if (request_fd == -1 || reply_fd == -1) {
+		fprintf(stderr, "open() failed\n");
+		return(EXIT_FAILURE);
+	}
+	if (ioctl(request_fd, SET_READ_HEADER, 1) == -1 ||
+	    ioctl(request_fd, SET_RECV_TIMEOUT, CALL_TIMEOUT) == -1 ||
+	    ioctl(reply_fd, SET_WRITE_HEADER, 1) == -1) {
+		fprintf(stderr, "ioctl() failed: %s\n", strerror(errno));
+		return(EXIT_FAILURE);
+	}
+
+	pthread_create(&server_tid, NULL, server, NULL);
+	for (i = 0; i < CALLERS; i++) {
+		pthread_create(&caller_tids[i], NULL, caller, argv[1]);
+	}
+	for (i = 0; i < CALLERS; i++) {
+		pthread_join(caller_tids[i], NULL);
+	}
+	printf("%d calls answered as expected\n", CALLERS * CALLS);
+
+	return(EXIT_SUCCESS);
+}
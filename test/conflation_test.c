@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../timed-msg-system.h"
+
+// Execute after sudoing in your shell
+
+#define MINOR 0
+#define KEYS 4
+#define UPDATES 10
+#define BUF_SIZE 64
+
+struct keyed_msg {
+	struct write_header_struct header;
+	char payload[BUF_SIZE];
+};
+
+int main(int argc, char *argv[])
+{
+	unsigned int major;
+	int ret, i, k, fd, len;
+	struct keyed_msg msg;
+	char buf[sizeof(struct read_header_struct) + BUF_SIZE];
+	struct read_header_struct *header = (struct read_header_struct *)buf;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage:sudo %s <pathname> <major>\n", argv[0]);
+		return(EXIT_FAILURE);
+	}
+
+	major = strtoul(argv[2], NULL, 0);
+
+	// Create a char device file with the given major and 0 with minor number
+	ret = mknod(argv[1], S_IFCHR, makedev(major, MINOR));
+	if (ret == -1) {
+		fprintf(stderr, "mknod() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	// Open the file
+	fd = open(argv[1], O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "open() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	if (ioctl(fd, SET_MINOR_MODE, MINOR_MODE_CONFLATE) == -1 ||
+	    ioctl(fd, SET_WRITE_HEADER, 1) == -1 ||
+	    ioctl(fd, SET_READ_HEADER, 1) == -1) {
+		fprintf(stderr, "ioctl() failed: %s\n", strerror(errno));
+		return(EXIT_FAILURE);
+	}
+
+	// Post several updates for each key
+	memset(&msg, 0, sizeof(msg));
+	msg.header.flags = WRITE_HEADER_KEY;
+	for (i = 0; i < UPDATES; i++) {
+		for (k = 0; k < KEYS; k++) {
+			msg.header.key = k;
+			len = snprintf(msg.payload, BUF_SIZE, "key %d update %d", k, i);
+			ret = write(fd, &msg, sizeof(msg.header) + len);
+			if (ret != sizeof(msg.header) + len) {
+				fprintf(stderr, "write() returned %d - unexpected\n", ret);
+				return(EXIT_FAILURE);
+			}
+		}
+	}
+
+	// Only the latest update of each key is delivered
+	for (k = 0; k < KEYS; k++) {
+		ret = read(fd, buf, sizeof(buf) - 1);
+		if (ret == -1) {
+			fprintf(stderr, "read() failed: %s\n", strerror(errno));
+			return(EXIT_FAILURE);
+		}
+		buf[ret] = '\0';
+		printf("offset %llu key %llu: %s\n", header->offset, header->key,
+		       buf + sizeof(struct read_header_struct));
+	}
+	ret = read(fd, buf, sizeof(buf));
+	if (ret == -1 && errno == ENOMSG) {
+		printf("%d messages delivered for %d writes as expected\n", KEYS,
+		       KEYS * UPDATES);
+	} else {
+		fprintf(stderr, "read() returned %d - unexpected\n", ret);
+		return(EXIT_FAILURE);
+	}
+
+	ioctl(fd, SET_MINOR_MODE, 0);
+
+	return(EXIT_SUCCESS);
+}
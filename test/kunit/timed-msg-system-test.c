@@ -0,0 +1,991 @@
+/*
+*  Copyright 2019 Federico Viglietta
+*
+*  This is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* KUnit suite of the queue core. This file is included at the end of
+* timed-msg-system.c when TIMED_MSG_KUNIT is defined, so that the static
+* helpers can be driven directly, without device nodes.
+*
+* The tests use the last device file, that is reinitialized before each test
+* and cleared after it: do not run the suite while that file is in use.
+*/
+
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+
+/* KUNIT_CASE_SLOW was introduced in 6.6 */
+#ifndef KUNIT_CASE_SLOW
+#define KUNIT_CASE_SLOW(test_name) KUNIT_CASE(test_name)
+#endif
+
+#define TEST_MINOR (MINORS - 1)
+#define TEST_MSG_SIZE 64
+#define TEST_DELAY_FOREVER (3600 * HZ)
+
+#define STRESS_WRITERS 4
+#define STRESS_READERS 4
+#define STRESS_MSGS 2000
+
+#define BENCH_ITERS 256
+static const unsigned int bench_depths[] = { 0, 64, 1024, 8192 };
+
+static unsigned int saved_max_storage_size;
+
+struct test_payload {
+	u32 writer;
+	u32 seq;
+};
+
+/**
+* __test_message - Allocate a message with a zeroed payload
+*
+* @test: the running test
+* @len: size of the payload
+*
+*/
+static struct message_struct *__test_message(struct kunit *test, size_t len)
+{
+	struct message_struct *msg;
+
+	msg = __alloc_message(len, NUMA_NO_NODE);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msg);
+	msg->buf = kzalloc(len, GFP_KERNEL);
+	if (len) {
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msg->buf);
+	}
+	return msg;
+}
+
+/**
+* __test_post - Post a message to the test device file, as dev_write() does
+*
+* @test: the running test
+* @len: size of the payload
+*
+* Returns the outcome of __post_message()
+*/
+static int __test_post(struct kunit *test, size_t len)
+{
+	int ret;
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct message_struct *msg;
+
+	msg = __test_message(test, len);
+	minor_lock(minor);
+	ret = __post_message(minor, msg, NULL);
+	if (ret >= 0) {
+		__awake_pending_reader(minor);
+	}
+	minor_unlock(minor);
+	return ret;
+}
+
+/**
+* __test_post_key - Post a keyed message to the test device file
+*
+* @test: the running test
+* @len: size of the payload
+* @key: key of the message
+*
+* Returns the outcome of __post_message()
+*/
+static int __test_post_key(struct kunit *test, size_t len,
+			   unsigned long long key)
+{
+	int ret;
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct message_struct *msg;
+
+	msg = __test_message(test, len);
+	msg->keyed = 1;
+	msg->key = key;
+	minor_lock(minor);
+	ret = __post_message(minor, msg, NULL);
+	minor_unlock(minor);
+	return ret;
+}
+
+/**
+* __test_dequeue - Remove the next message of a session, as dev_read() does
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the reader
+* @payload: if not NULL, filled with the start of the payload
+*
+* Returns 1 if a message was removed, 0 otherwise
+*
+* NOTE Must be called with the mutex of @minor held
+*/
+static int __test_dequeue(struct minor_struct *minor,
+			  struct session_struct *session,
+			  struct test_payload *payload)
+{
+	struct message_struct *msg;
+
+	msg = __next_message(minor, session);
+	if (msg == NULL) {
+		return 0;
+	}
+	if (payload != NULL) {
+		memcpy(payload, msg->buf, sizeof(struct test_payload));
+	}
+	__unlink_message(minor, msg);
+	__free_message(msg);
+	return 1;
+}
+
+/**
+* __test_drain - Remove all the messages readable by a session
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the reader
+*
+* NOTE Must be called with the mutex of @minor held
+*/
+static void __test_drain(struct minor_struct *minor,
+			 struct session_struct *session)
+{
+	while (__test_dequeue(minor, session, NULL)) {
+		continue;
+	}
+}
+
+/**
+* __test_session - Open a session on the test device file, as dev_open() does
+*
+* @test: the running test
+*
+*/
+static struct session_struct *__test_session(struct kunit *test)
+{
+	struct session_struct *session;
+
+	session = kmalloc(sizeof(struct session_struct), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, session);
+	session->write_wq = alloc_workqueue("timed-msg-test", WQ_MEM_RECLAIM,
+					    0);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, session->write_wq);
+	__init_session(session);
+	session->minor = TEST_MINOR;
+	minor_lock(&(minors[TEST_MINOR]));
+	list_add_tail(&(session->list), &(minors[TEST_MINOR].sessions));
+	minor_unlock(&(minors[TEST_MINOR]));
+	return session;
+}
+
+/**
+* __test_release - Close a session opened by __test_session()
+*
+* @session: pointer to %session_struct representing the I/O session
+*
+*/
+static void __test_release(struct session_struct *session)
+{
+	flush_workqueue(session->write_wq);
+	destroy_workqueue(session->write_wq);
+	cancel_delayed_work_sync(&(session->cork_work));
+	minor_lock(&(minors[TEST_MINOR]));
+	list_del(&(session->list));
+	minor_unlock(&(minors[TEST_MINOR]));
+	timer_delete_sync(&(session->lowat_timer));
+	kfree(session);
+}
+
+/**
+* __test_defer - Queue a deferred write, as dev_write() does
+*
+* @test: the running test
+* @session: pointer to %session_struct representing the writer
+* @len: size of the payload
+* @delay: delay of the post, in jiffies
+*
+*/
+static void __test_defer(struct kunit *test, struct session_struct *session,
+			 size_t len, unsigned long delay)
+{
+	struct pending_write_struct *pending_write;
+
+	pending_write = kmalloc(sizeof(struct pending_write_struct),
+				GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pending_write);
+	pending_write->minor = TEST_MINOR;
+	pending_write->session = session;
+	pending_write->msg = __test_message(test, len);
+	pending_write->msg->scheduled = ktime_get();
+	INIT_LIST_HEAD(&(pending_write->list));
+	INIT_DELAYED_WORK(&(pending_write->delayed_work), __deferred_write);
+	session_lock(session);
+	pending_write->seq = session->deferred_seq++;
+	list_add_tail(&(pending_write->list), &(session->pending_writes));
+	session_unlock(session);
+	queue_delayed_work(session->write_wq, &(pending_write->delayed_work),
+			   delay);
+}
+
+/**
+* __test_reader - Queue a pending reader, as a blocking dev_read() does
+*
+* @minor: pointer to %minor_struct representing the device file
+* @pending_read: pointer to the %pending_read_struct to queue
+* @session: pointer to %session_struct representing the reader
+* @prio: priority of the reader
+*
+* NOTE Must be called with the mutex of @minor held
+*/
+static void __test_reader(struct minor_struct *minor,
+			  struct pending_read_struct *pending_read,
+			  struct session_struct *session, int prio)
+{
+	pending_read->msg_available = 0;
+	pending_read->flushing = 0;
+	pending_read->session = session;
+	plist_node_init(&(pending_read->list), prio);
+	pending_read->corr_id = 0;
+	pending_read->reply = NULL;
+	INIT_HLIST_NODE(&(pending_read->call_node));
+	plist_add(&(pending_read->list), &(minor->pending_reads));
+}
+
+static int timed_msg_test_init(struct kunit *test)
+{
+	saved_max_storage_size = max_storage_size;
+	__init_minor(&(minors[TEST_MINOR]));
+	return 0;
+}
+
+static void timed_msg_test_exit(struct kunit *test)
+{
+	__clear_minor(&(minors[TEST_MINOR]));
+	max_storage_size = saved_max_storage_size;
+}
+
+/*********************************Correctness***********************************/
+
+static void post_dequeue_fifo_test(struct kunit *test)
+{
+	int i;
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct session_struct *session = __test_session(test);
+	struct message_struct *msg;
+
+	for (i = 1; i <= 3; i++) {
+		KUNIT_EXPECT_EQ(test, __test_post(test, i), i);
+	}
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 3U);
+	KUNIT_EXPECT_EQ(test, minor->current_size, 6U);
+
+	minor_lock(minor);
+	for (i = 0; i < 3; i++) {
+		msg = __next_message(minor, session);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msg);
+		KUNIT_EXPECT_EQ(test, msg->offset, (unsigned long)i);
+		KUNIT_EXPECT_EQ(test, msg->size, (unsigned int)(i + 1));
+		__unlink_message(minor, msg);
+		__free_message(msg);
+	}
+	KUNIT_EXPECT_PTR_EQ(test, __next_message(minor, session), NULL);
+	minor_unlock(minor);
+	KUNIT_EXPECT_EQ(test, minor->current_size, 0U);
+
+	__test_release(session);
+}
+
+static void post_overflow_test(struct kunit *test)
+{
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+
+	max_storage_size = TEST_MSG_SIZE;
+	KUNIT_EXPECT_EQ(test, __test_post(test, TEST_MSG_SIZE), TEST_MSG_SIZE);
+	KUNIT_EXPECT_EQ(test, __test_post(test, 1), -ENOSPC);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 1U);
+
+	minor->overflow_policy = OVERFLOW_DROP_NEW;
+	KUNIT_EXPECT_EQ(test, __test_post(test, 1), 1);
+	KUNIT_EXPECT_EQ(test, minor->dropped_new, 1UL);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 1U);
+	/* The discarded message leaves a gap in the offsets */
+	KUNIT_EXPECT_EQ(test, minor->next_offset, 2UL);
+
+	minor->overflow_policy = OVERFLOW_DROP_OLDEST;
+	KUNIT_EXPECT_EQ(test, __test_post(test, 1), 1);
+	KUNIT_EXPECT_EQ(test, minor->dropped_oldest, 1UL);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 1U);
+	KUNIT_EXPECT_EQ(test, __head_offset(minor), 2UL);
+}
+
+static void conflate_overflow_test(struct kunit *test)
+{
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct message_struct *msg;
+
+	max_storage_size = 6;
+	minor->mode = MINOR_MODE_CONFLATE;
+	KUNIT_EXPECT_EQ(test, __test_post_key(test, 4, 1), 4);
+	KUNIT_EXPECT_EQ(test, __test_post(test, 2), 2);
+
+	/* The new content does not fit: the old one must survive */
+	KUNIT_EXPECT_EQ(test, __test_post_key(test, 5, 1), -ENOSPC);
+	minor->overflow_policy = OVERFLOW_DROP_NEW;
+	KUNIT_EXPECT_EQ(test, __test_post_key(test, 5, 1), 5);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 2U);
+	KUNIT_EXPECT_EQ(test, minor->current_size, 6U);
+	KUNIT_EXPECT_EQ(test, minor->conflated, 0UL);
+
+	/* Dropping old messages makes room, the key moves to the tail */
+	minor->overflow_policy = OVERFLOW_DROP_OLDEST;
+	KUNIT_EXPECT_EQ(test, __test_post_key(test, 5, 1), 5);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 1U);
+	KUNIT_EXPECT_EQ(test, minor->conflated, 1UL);
+	KUNIT_EXPECT_EQ(test, minor->dropped_oldest, 1UL);
+	msg = list_first_entry(&(minor->fifo), struct message_struct, list);
+	KUNIT_EXPECT_EQ(test, msg->size, 5U);
+	KUNIT_EXPECT_PTR_EQ(test, __find_key(minor, 1), msg);
+}
+
+static void awake_pending_reader_test(struct kunit *test)
+{
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct session_struct *session = __test_session(test);
+	struct pending_read_struct low;
+	struct pending_read_struct high;
+
+	minor_lock(minor);
+	__test_reader(minor, &low, session, 10);
+	__test_reader(minor, &high, session, 5);
+	/* Nothing to read, nobody is awaken */
+	__awake_pending_reader(minor);
+	KUNIT_EXPECT_EQ(test, high.msg_available, 0);
+	minor_unlock(minor);
+
+	/* The reader with the lower priority value goes first */
+	__test_post(test, TEST_MSG_SIZE);
+	KUNIT_EXPECT_EQ(test, high.msg_available, 1);
+	KUNIT_EXPECT_EQ(test, low.msg_available, 0);
+	KUNIT_EXPECT_TRUE(test, plist_node_empty(&(high.list)));
+
+	__test_post(test, TEST_MSG_SIZE);
+	KUNIT_EXPECT_EQ(test, low.msg_available, 1);
+	KUNIT_EXPECT_TRUE(test, plist_head_empty(&(minor->pending_reads)));
+
+	__test_release(session);
+}
+
+static void unblock_reads_test(struct kunit *test)
+{
+	int i;
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct session_struct *session = __test_session(test);
+	struct pending_read_struct readers[4];
+
+	minor_lock(minor);
+	for (i = 0; i < ARRAY_SIZE(readers); i++) {
+		__test_reader(minor, &(readers[i]), session, i);
+	}
+	__unblock_reads(minor);
+	minor_unlock(minor);
+
+	for (i = 0; i < ARRAY_SIZE(readers); i++) {
+		KUNIT_EXPECT_EQ(test, readers[i].flushing, 1);
+		KUNIT_EXPECT_EQ(test, readers[i].msg_available, 0);
+	}
+	KUNIT_EXPECT_TRUE(test, plist_head_empty(&(minor->pending_reads)));
+
+	__test_release(session);
+}
+
+static void revoke_delayed_messages_test(struct kunit *test)
+{
+	int i;
+	struct completion_struct completion;
+	struct session_struct *session = __test_session(test);
+
+	session->post_completions = 1;
+	for (i = 0; i < 8; i++) {
+		__test_defer(test, session, TEST_MSG_SIZE, TEST_DELAY_FOREVER);
+	}
+	session_lock(session);
+	__revoke_delayed_messages(session);
+	KUNIT_EXPECT_TRUE(test, list_empty(&(session->pending_writes)));
+	session_unlock(session);
+
+	for (i = 0; i < 8; i++) {
+		KUNIT_ASSERT_EQ(test, __pop_completion(session, &completion), 0);
+		KUNIT_EXPECT_EQ(test, completion.type, COMPLETION_POST);
+		KUNIT_EXPECT_EQ(test, completion.status, -ECANCELED);
+		KUNIT_EXPECT_EQ(test, completion.cookie, (unsigned long long)i);
+	}
+	KUNIT_EXPECT_EQ(test, __pop_completion(session, &completion), -ENOMSG);
+	KUNIT_EXPECT_EQ(test, minors[TEST_MINOR].msg_count, 0U);
+
+	__test_release(session);
+}
+
+static void deferred_write_test(struct kunit *test)
+{
+	struct completion_struct completion;
+	struct session_struct *session = __test_session(test);
+
+	max_storage_size = TEST_MSG_SIZE;
+	session->post_completions = 1;
+	__test_defer(test, session, TEST_MSG_SIZE, 0);
+	flush_workqueue(session->write_wq);
+	__test_defer(test, session, TEST_MSG_SIZE, 0);
+	flush_workqueue(session->write_wq);
+
+	KUNIT_EXPECT_EQ(test, minors[TEST_MINOR].msg_count, 1U);
+	KUNIT_EXPECT_TRUE(test, list_empty(&(session->pending_writes)));
+	KUNIT_ASSERT_EQ(test, __pop_completion(session, &completion), 0);
+	KUNIT_EXPECT_EQ(test, completion.cookie, 0ULL);
+	KUNIT_EXPECT_EQ(test, completion.status, 0);
+	KUNIT_EXPECT_EQ(test, completion.offset, 0ULL);
+	KUNIT_ASSERT_EQ(test, __pop_completion(session, &completion), 0);
+	KUNIT_EXPECT_EQ(test, completion.cookie, 1ULL);
+	KUNIT_EXPECT_EQ(test, completion.status, -ENOSPC);
+	KUNIT_EXPECT_EQ(test, completion.offset, COMPLETION_NO_OFFSET);
+
+	__test_release(session);
+}
+
+static void cork_bound_test(struct kunit *test)
+{
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct session_struct *session = __test_session(test);
+
+	/* Room for two messages and a half, the default max_bytes */
+	max_storage_size = TEST_MSG_SIZE * 5 / 2;
+	minor->overflow_policy = OVERFLOW_REJECT;
+	session->corked = 1;
+	KUNIT_EXPECT_EQ(test, __cork_message(session,
+					     __test_message(test,
+							    TEST_MSG_SIZE)), 0);
+	KUNIT_EXPECT_EQ(test, __cork_message(session,
+					     __test_message(test,
+							    TEST_MSG_SIZE)), 0);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 0U);
+
+	/* The third message would not fit: the staged batch goes first */
+	KUNIT_EXPECT_EQ(test, __cork_message(session,
+					     __test_message(test,
+							    TEST_MSG_SIZE)), 0);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 2U);
+	KUNIT_EXPECT_EQ(test, session->cork_count, 1U);
+	KUNIT_EXPECT_EQ(test, minor->rejected_batches, 0UL);
+
+	minor_lock(minor);
+	__test_drain(minor, session);
+	minor_unlock(minor);
+	KUNIT_EXPECT_EQ(test, __uncork(session), 1);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 1U);
+
+	__test_release(session);
+}
+
+static void peek_message_test(struct kunit *test)
+{
+	unsigned int size = 0;
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct session_struct *session = __test_session(test);
+
+	KUNIT_EXPECT_EQ(test, __peek_message(minor, session, NULL, 0, NULL),
+			(long)-ENOMSG);
+	KUNIT_EXPECT_EQ(test, __test_post(test, 3), 3);
+	KUNIT_EXPECT_EQ(test, __test_post(test, 5), 5);
+	KUNIT_EXPECT_EQ(test, __peek_message(minor, session, NULL, 0, &size),
+			3L);
+	KUNIT_EXPECT_EQ(test, size, 3U);
+	/* Peeking twice sees the same message */
+	KUNIT_EXPECT_EQ(test, __peek_message(minor, session, NULL, 0, NULL),
+			3L);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 2U);
+
+	minor_lock(minor);
+	KUNIT_EXPECT_EQ(test, __test_dequeue(minor, session, NULL), 1);
+	minor_unlock(minor);
+	KUNIT_EXPECT_EQ(test, __peek_message(minor, session, NULL, 0, NULL),
+			5L);
+
+	session->read_header = 1;
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 1U);
+	KUNIT_EXPECT_EQ(test, __read_len(session,
+					 list_first_entry(&(minor->fifo),
+							  struct message_struct,
+							  list)),
+			sizeof(struct read_header_struct) + 5);
+
+	__test_release(session);
+}
+
+static void strict_read_wake_test(struct kunit *test)
+{
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct session_struct *first = __test_session(test);
+	struct session_struct *second = __test_session(test);
+	struct pending_read_struct first_read;
+	struct pending_read_struct second_read;
+	struct inode *inode;
+	struct file *filep;
+
+	inode = kunit_kzalloc(test, sizeof(struct inode), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode);
+	filep = kunit_kzalloc(test, sizeof(struct file), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, filep);
+	inode->i_rdev = MKDEV(0, TEST_MINOR);
+	filep->f_inode = inode;
+	filep->private_data = first;
+	first->strict_read = 1;
+
+	minor_lock(minor);
+	__test_reader(minor, &first_read, first, 5);
+	__test_reader(minor, &second_read, second, 10);
+	minor_unlock(minor);
+	__test_post(test, TEST_MSG_SIZE);
+	KUNIT_EXPECT_EQ(test, first_read.msg_available, 1);
+	KUNIT_EXPECT_EQ(test, second_read.msg_available, 0);
+
+	/* The awaken reader is short of room, the other one takes over */
+	KUNIT_EXPECT_EQ(test, dev_read(filep, NULL, TEST_MSG_SIZE - 1, NULL),
+			(ssize_t)-EMSGSIZE);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 1U);
+	KUNIT_EXPECT_EQ(test, second_read.msg_available, 1);
+
+	minor_lock(minor);
+	if (!plist_node_empty(&(second_read.list))) {
+		plist_del(&(second_read.list), &(minor->pending_reads));
+	}
+	minor_unlock(minor);
+	__test_release(first);
+	__test_release(second);
+}
+
+static void snapshot_restore_test(struct kunit *test)
+{
+	size_t size, split;
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct session_struct *session = __test_session(test);
+	struct snapshot_state state = { .minor = minor };
+	struct message_struct *msg;
+	struct group_struct *group;
+	unsigned int groups;
+	char *dump;
+
+	KUNIT_EXPECT_EQ(test, __test_post(test, 1), 1);
+	KUNIT_EXPECT_EQ(test, __test_post(test, 2), 2);
+	KUNIT_EXPECT_EQ(test, __test_post(test, 3), 3);
+	minor_lock(minor);
+	KUNIT_EXPECT_EQ(test, __test_dequeue(minor, session, NULL), 1);
+	KUNIT_EXPECT_EQ(test, __join_group(minor, session, "g"), 0);
+	session->group->offset = 2;
+	size = __snapshot_minor(minor, NULL, SIZE_MAX, jiffies, true);
+	dump = kunit_kzalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dump);
+	KUNIT_EXPECT_EQ(test, __snapshot_minor(minor, dump, size, jiffies, true),
+			size);
+	minor_unlock(minor);
+	__test_release(session);
+	__clear_minor(minor);
+	__init_minor(minor);
+
+	/* Restore in two chunks, the first ending within a record */
+	state.size = sizeof(struct snapshot_header) +
+	    MAX_GROUPS * sizeof(struct snapshot_group) +
+	    sizeof(struct snapshot_record) + max_message_size;
+	state.buf = kunit_kzalloc(test, state.size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, state.buf);
+	split = sizeof(struct snapshot_header) + sizeof(struct snapshot_group) +
+	    sizeof(struct snapshot_record);
+	memcpy(state.buf, dump, split);
+	state.len = split;
+	KUNIT_EXPECT_EQ(test, __snapshot_restore(&state), 0);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 0U);
+	memcpy(state.buf + state.len, dump + split, size - split);
+	state.len += size - split;
+	KUNIT_EXPECT_EQ(test, __snapshot_restore(&state), 0);
+	KUNIT_EXPECT_EQ(test, state.len, (size_t)0);
+
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 2U);
+	KUNIT_EXPECT_EQ(test, minor->current_size, 5U);
+	KUNIT_EXPECT_EQ(test, minor->next_offset, 3UL);
+	msg = list_first_entry(&(minor->fifo), struct message_struct, list);
+	KUNIT_EXPECT_EQ(test, msg->offset, 1UL);
+	KUNIT_EXPECT_EQ(test, msg->size, 2U);
+	group = __find_group(minor, "g", &groups);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, group);
+	KUNIT_EXPECT_EQ(test, group->offset, 2UL);
+	KUNIT_EXPECT_EQ(test, group->members, 0U);
+
+	/* A second restore needs an empty device file */
+	state.loaded_header = 0;
+	memcpy(state.buf, dump, sizeof(struct snapshot_header));
+	state.len = sizeof(struct snapshot_header);
+	KUNIT_EXPECT_EQ(test, __snapshot_restore(&state), -EBUSY);
+	memset(state.buf, 0, sizeof(struct snapshot_header));
+	KUNIT_EXPECT_EQ(test, __snapshot_restore(&state), -EINVAL);
+
+	/* Offsets are not reused even if the log was consumed to its tail */
+	session = __test_session(test);
+	minor_lock(minor);
+	__test_drain(minor, session);
+	size = __snapshot_minor(minor, NULL, SIZE_MAX, jiffies, true);
+	KUNIT_EXPECT_EQ(test, __snapshot_minor(minor, dump, size, jiffies, true),
+			size);
+	minor_unlock(minor);
+	__test_release(session);
+	__clear_minor(minor);
+	__init_minor(minor);
+	state.loaded_header = 0;
+	memcpy(state.buf, dump, size);
+	state.len = size;
+	KUNIT_EXPECT_EQ(test, __snapshot_restore(&state), 0);
+	KUNIT_EXPECT_EQ(test, minor->msg_count, 0U);
+	KUNIT_EXPECT_EQ(test, minor->next_offset, 3UL);
+	KUNIT_EXPECT_EQ(test, __test_post(test, 1), 1);
+	KUNIT_EXPECT_EQ(test, list_first_entry(&(minor->fifo),
+					       struct message_struct,
+					       list)->offset, 3UL);
+}
+
+/**********************************Stress***************************************/
+
+struct stress_ctx {
+	struct kunit *test;
+	struct session_struct *session;
+	atomic_t consumed;
+	atomic_t errors;
+	struct completion done;
+};
+
+struct stress_thread {
+	struct stress_ctx *ctx;
+	u32 id;
+};
+
+static int __stress_writer(void *data)
+{
+	u32 i;
+	struct stress_thread *thread = data;
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct message_struct *msg;
+	struct test_payload *payload;
+
+	for (i = 0; i < STRESS_MSGS; i++) {
+		msg = __alloc_message(sizeof(struct test_payload),
+				      NUMA_NO_NODE);
+		payload = kmalloc(sizeof(struct test_payload), GFP_KERNEL);
+		if (msg == NULL || payload == NULL) {
+			kfree(msg);
+			kfree(payload);
+			/* Readers do not wait for the missing messages */
+			atomic_add(STRESS_MSGS - i, &(thread->ctx->errors));
+			break;
+		}
+		payload->writer = thread->id;
+		payload->seq = i;
+		msg->buf = (char *)payload;
+		minor_lock(minor);
+		if (__post_message(minor, msg, NULL) < 0) {
+			atomic_inc(&(thread->ctx->errors));
+		} else {
+			__awake_pending_reader(minor);
+		}
+		minor_unlock(minor);
+	}
+	complete(&(thread->ctx->done));
+	return 0;
+}
+
+static int __stress_reader(void *data)
+{
+	int dequeued;
+	u32 next[STRESS_WRITERS] = { 0 };
+	struct stress_thread *thread = data;
+	struct stress_ctx *ctx = thread->ctx;
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct test_payload payload;
+
+	while (atomic_read(&(ctx->consumed)) + atomic_read(&(ctx->errors))
+	       < STRESS_WRITERS * STRESS_MSGS) {
+		minor_lock(minor);
+		dequeued = __test_dequeue(minor, ctx->session, &payload);
+		minor_unlock(minor);
+		if (!dequeued) {
+			cond_resched();
+			continue;
+		}
+		atomic_inc(&(ctx->consumed));
+		/* Each reader sees the messages of a writer in FIFO order */
+		if (payload.writer >= STRESS_WRITERS
+		    || payload.seq < next[payload.writer]) {
+			atomic_inc(&(ctx->errors));
+			continue;
+		}
+		next[payload.writer] = payload.seq + 1;
+	}
+	complete(&(ctx->done));
+	return 0;
+}
+
+static void concurrent_post_dequeue_test(struct kunit *test)
+{
+	int i, started;
+	struct stress_ctx ctx;
+	struct stress_thread threads[STRESS_WRITERS + STRESS_READERS];
+	struct task_struct *task;
+
+	max_storage_size = UINT_MAX;
+	ctx.test = test;
+	ctx.session = __test_session(test);
+	atomic_set(&(ctx.consumed), 0);
+	atomic_set(&(ctx.errors), 0);
+	init_completion(&(ctx.done));
+
+	for (i = 0; i < ARRAY_SIZE(threads); i++) {
+		threads[i].ctx = &ctx;
+		threads[i].id = i;
+		if (i < STRESS_WRITERS) {
+			task = kthread_run(__stress_writer, &(threads[i]),
+					   "timed-msg-w%d", i);
+		} else {
+			task = kthread_run(__stress_reader, &(threads[i]),
+					   "timed-msg-r%d", i);
+		}
+		if (IS_ERR(task)) {
+			/* Readers do not wait for the writers never started */
+			if (i < STRESS_WRITERS) {
+				atomic_add(STRESS_MSGS * (STRESS_WRITERS - i),
+					   &(ctx.errors));
+			}
+			break;
+		}
+	}
+	/* The threads use ctx, on this stack, until they complete */
+	started = i;
+	for (i = 0; i < started; i++) {
+		wait_for_completion(&(ctx.done));
+	}
+	if (started < ARRAY_SIZE(threads)) {
+		__test_release(ctx.session);
+		KUNIT_FAIL(test, "cannot start the stress threads");
+		return;
+	}
+
+	KUNIT_EXPECT_EQ(test, atomic_read(&(ctx.errors)), 0);
+	KUNIT_EXPECT_EQ(test, atomic_read(&(ctx.consumed)),
+			STRESS_WRITERS * STRESS_MSGS);
+	KUNIT_EXPECT_EQ(test, minors[TEST_MINOR].msg_count, 0U);
+	KUNIT_EXPECT_EQ(test, minors[TEST_MINOR].next_offset,
+			(unsigned long)(STRESS_WRITERS * STRESS_MSGS));
+
+	__test_release(ctx.session);
+}
+
+static void concurrent_revoke_test(struct kunit *test)
+{
+	int i, posted = 0, revoked = 0;
+	struct completion_struct completion;
+	struct session_struct *session = __test_session(test);
+
+	max_storage_size = UINT_MAX;
+	session->post_completions = 1;
+	/* Half of the writes fire while they are being revoked */
+	for (i = 0; i < COMPLETION_RING; i++) {
+		__test_defer(test, session, TEST_MSG_SIZE, i % 2);
+	}
+	session_lock(session);
+	__revoke_delayed_messages(session);
+	session_unlock(session);
+	flush_workqueue(session->write_wq);
+
+	while (!__pop_completion(session, &completion)) {
+		if (completion.status == 0) {
+			posted++;
+		} else if (completion.status == -ECANCELED) {
+			revoked++;
+		}
+	}
+	KUNIT_EXPECT_EQ(test, posted + revoked, COMPLETION_RING);
+	KUNIT_EXPECT_EQ(test, minors[TEST_MINOR].msg_count,
+			(unsigned int)posted);
+	KUNIT_EXPECT_TRUE(test, list_empty(&(session->pending_writes)));
+
+	__test_release(session);
+}
+
+/******************************Microbenchmarks**********************************/
+
+/**
+* __bench_fill - Bring the test device file to a given depth
+*
+* @test: the running test
+* @depth: number of stored messages
+*
+*/
+static void __bench_fill(struct kunit *test, unsigned int depth)
+{
+	unsigned int i;
+
+	for (i = 0; i < depth; i++) {
+		KUNIT_ASSERT_GE(test, __test_post(test, TEST_MSG_SIZE), 0);
+	}
+}
+
+/**
+* __bench_report - Log the cost of an operation
+*
+* @test: the running test
+* @op: name of the operation
+* @depth: queue depth the operation was measured at
+* @ns: total time
+* @ops: number of operations
+*
+*/
+static void __bench_report(struct kunit *test, const char *op,
+			   unsigned int depth, u64 ns, unsigned int ops)
+{
+	kunit_info(test, "%s depth %u: %llu ns/op\n", op, depth,
+		   div_u64(ns, ops));
+}
+
+static void bench_post_dequeue(struct kunit *test)
+{
+	int i, d;
+	u64 start, ns;
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct session_struct *session = __test_session(test);
+	struct message_struct **msgs;
+
+	max_storage_size = UINT_MAX;
+	msgs = kunit_kcalloc(test, BENCH_ITERS, sizeof(*msgs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msgs);
+
+	for (d = 0; d < ARRAY_SIZE(bench_depths); d++) {
+		__bench_fill(test, bench_depths[d]);
+		/* Allocation is not part of the measure */
+		for (i = 0; i < BENCH_ITERS; i++) {
+			msgs[i] = __test_message(test, TEST_MSG_SIZE);
+		}
+
+		minor_lock(minor);
+		start = ktime_get_ns();
+		for (i = 0; i < BENCH_ITERS; i++) {
+			__post_message(minor, msgs[i], NULL);
+		}
+		ns = ktime_get_ns() - start;
+		minor_unlock(minor);
+		__bench_report(test, "post", bench_depths[d], ns, BENCH_ITERS);
+
+		minor_lock(minor);
+		start = ktime_get_ns();
+		for (i = 0; i < BENCH_ITERS; i++) {
+			__test_dequeue(minor, session, NULL);
+		}
+		ns = ktime_get_ns() - start;
+		minor_unlock(minor);
+		__bench_report(test, "dequeue", bench_depths[d], ns,
+			       BENCH_ITERS);
+
+		minor_lock(minor);
+		__test_drain(minor, session);
+		minor_unlock(minor);
+	}
+
+	__test_release(session);
+}
+
+static void bench_wake(struct kunit *test)
+{
+	int i, d;
+	u64 start, ns;
+	struct minor_struct *minor = &(minors[TEST_MINOR]);
+	struct session_struct *session = __test_session(test);
+	struct pending_read_struct pending_read;
+
+	max_storage_size = UINT_MAX;
+	for (d = 0; d < ARRAY_SIZE(bench_depths); d++) {
+		/* A reader is awaken only if there is something to read */
+		__bench_fill(test, bench_depths[d] ? bench_depths[d] : 1);
+
+		minor_lock(minor);
+		ns = 0;
+		for (i = 0; i < BENCH_ITERS; i++) {
+			__test_reader(minor, &pending_read, session, 0);
+			start = ktime_get_ns();
+			__awake_pending_reader(minor);
+			ns += ktime_get_ns() - start;
+			KUNIT_EXPECT_EQ(test, pending_read.msg_available, 1);
+		}
+		__test_drain(minor, session);
+		minor_unlock(minor);
+		__bench_report(test, "wake", bench_depths[d], ns, BENCH_ITERS);
+	}
+
+	__test_release(session);
+}
+
+static void bench_revoke(struct kunit *test)
+{
+	unsigned int i, d, depth;
+	u64 start, ns;
+	struct session_struct *session = __test_session(test);
+
+	for (d = 0; d < ARRAY_SIZE(bench_depths); d++) {
+		/* Here the depth is the number of pending writes */
+		depth = bench_depths[d] ? bench_depths[d] : 1;
+		for (i = 0; i < depth; i++) {
+			__test_defer(test, session, TEST_MSG_SIZE,
+				     TEST_DELAY_FOREVER);
+		}
+
+		session_lock(session);
+		start = ktime_get_ns();
+		__revoke_delayed_messages(session);
+		ns = ktime_get_ns() - start;
+		session_unlock(session);
+		__bench_report(test, "revoke", depth, ns, depth);
+	}
+
+	__test_release(session);
+}
+
+static struct kunit_case timed_msg_test_cases[] = {
+	KUNIT_CASE(post_dequeue_fifo_test),
+	KUNIT_CASE(post_overflow_test),
+	KUNIT_CASE(conflate_overflow_test),
+	KUNIT_CASE(awake_pending_reader_test),
+	KUNIT_CASE(unblock_reads_test),
+	KUNIT_CASE(revoke_delayed_messages_test),
+	KUNIT_CASE(deferred_write_test),
+	KUNIT_CASE(cork_bound_test),
+	KUNIT_CASE(peek_message_test),
+	KUNIT_CASE(strict_read_wake_test),
+	KUNIT_CASE(snapshot_restore_test),
+	KUNIT_CASE_SLOW(concurrent_post_dequeue_test),
+	KUNIT_CASE_SLOW(concurrent_revoke_test),
+	KUNIT_CASE_SLOW(bench_post_dequeue),
+	KUNIT_CASE_SLOW(bench_wake),
+	KUNIT_CASE_SLOW(bench_revoke),
+	{}
+};
+
+static struct kunit_suite timed_msg_test_suite = {
+	.name = "timed-msg-system",
+	.init = timed_msg_test_init,
+	.exit = timed_msg_test_exit,
+	.test_cases = timed_msg_test_cases,
+};
+
+kunit_test_suite(timed_msg_test_suite);
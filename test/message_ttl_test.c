@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../timed-msg-system.h"
+
+// Execute after sudoing in your shell
+
+#define MINOR 0
+#define MAX_MSG_SIZE 128
+
+
+int main(int argc, char *argv[])
+{
+	unsigned int major, ttl;
+	int ret, fd;
+	char msg[MAX_MSG_SIZE];
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage:sudo %s <pathname> <major> <ttl-msecs>\n", argv[0]);
+		return(EXIT_FAILURE);
+	}
+
+	major = strtoul(argv[2], NULL, 0);
+	ttl = strtoul(argv[3], NULL, 0); // mseconds
+
+	// Create a char device file with the given major and 0 with minor number
+	ret = mknod(argv[1], S_IFCHR, makedev(major, MINOR));
+	if (ret == -1) {
+		fprintf(stderr, "mknod() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	// Open the file
+	fd = open(argv[1], O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "open() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	// Set the time to live of the messages
+	ret = ioctl(fd, SET_MSG_TTL, ttl);
+	if (ret == -1) {
+		fprintf(stderr, "ioctl() failed: %s\n", strerror(errno));
+		return(EXIT_FAILURE);
+	}
+
+	printf("Writing a message...\n");
+	ret = write(fd, "stale", strlen("stale") + 1);
+	if (ret == -1) {
+		fprintf(stderr, "write() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	// Let the message expire
+	usleep(2 * ttl * 1000);
+
+	printf("Reading...\n");
+	ret = read(fd, msg, MAX_MSG_SIZE);
+	if (ret == -1 && errno == ENOMSG) {
+		printf("read() returned -1 with errno ENOMSG as expected\n");
+		return(EXIT_SUCCESS);
+	}
+	printf("read() returned %d - unexpected\n", ret);
+	return(EXIT_FAILURE);
+}
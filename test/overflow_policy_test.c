@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../timed-msg-system.h"
+
+// Execute after sudoing in your shell
+// The test assumes the default max_storage_size and max_message_size
+
+#define MINOR 0
+#define MSG_SIZE 4096
+#define MESSAGES 20
+
+
+int main(int argc, char *argv[])
+{
+	unsigned int major;
+	int ret, i, fd;
+	char msg[MSG_SIZE];
+	char buf[sizeof(struct read_header_struct) + MSG_SIZE];
+	struct read_header_struct *header = (struct read_header_struct *)buf;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage:sudo %s <pathname> <major>\n", argv[0]);
+		return(EXIT_FAILURE);
+	}
+
+	major = strtoul(argv[2], NULL, 0);
+
+	// Create a char device file with the given major and 0 with minor number
+	ret = mknod(argv[1], S_IFCHR, makedev(major, MINOR));
+	if (ret == -1) {
+		fprintf(stderr, "mknod() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	// Open the file
+	fd = open(argv[1], O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "open() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	if (ioctl(fd, SET_OVERFLOW_POLICY, OVERFLOW_DROP_OLDEST) == -1 ||
+	    ioctl(fd, SET_READ_HEADER, 1) == -1) {
+		fprintf(stderr, "ioctl() failed: %s\n", strerror(errno));
+		return(EXIT_FAILURE);
+	}
+
+	// Post more messages than the device file can hold
+	memset(msg, 'x', MSG_SIZE);
+	for (i = 0; i < MESSAGES; i++) {
+		ret = write(fd, msg, MSG_SIZE);
+		if (ret != MSG_SIZE) {
+			fprintf(stderr, "write() returned %d - unexpected\n", ret);
+			return(EXIT_FAILURE);
+		}
+	}
+	printf("%d writes succeeded as expected\n", MESSAGES);
+
+	// The oldest messages have been discarded
+	ret = read(fd, buf, sizeof(buf));
+	if (ret == -1) {
+		fprintf(stderr, "read() failed: %s\n", strerror(errno));
+		return(EXIT_FAILURE);
+	}
+	if (header->offset == 0) {
+		fprintf(stderr, "the oldest message was not discarded\n");
+		return(EXIT_FAILURE);
+	}
+	printf("first offset read: %llu\n", header->offset);
+
+	// Drain the device file and restore the default policy
+	while (read(fd, buf, sizeof(buf)) > 0);
+	ioctl(fd, SET_OVERFLOW_POLICY, OVERFLOW_REJECT);
+
+	return(EXIT_SUCCESS);
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../timed-msg-system.h"
+
+// Execute after sudoing in your shell
+
+#define MINOR 0
+#define MAX_MSG_SIZE 128
+#define MESSAGES 3
+
+// Read a message and check it matches the expected one
+static int expect(int fd, const char *expected)
+{
+	char msg[MAX_MSG_SIZE];
+	int ret;
+
+	ret = read(fd, msg, MAX_MSG_SIZE);
+	if (ret == -1) {
+		fprintf(stderr, "read() failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (strcmp(msg, expected) != 0) {
+		fprintf(stderr, "read: %s - expected %s\n", msg, expected);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int major;
+	unsigned long offset;
+	int ret, i, fd_a, fd_b, fd_c;
+	char msg[MAX_MSG_SIZE];
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage:sudo %s <pathname> <major>\n", argv[0]);
+		return(EXIT_FAILURE);
+	}
+
+	major = strtoul(argv[2], NULL, 0);
+
+	// Create a char device file with the given major and 0 with minor number
+	ret = mknod(argv[1], S_IFCHR, makedev(major, MINOR));
+	if (ret == -1) {
+		fprintf(stderr, "mknod() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	// Open three sessions
+	fd_a = open(argv[1], O_RDWR);
+	fd_b = open(argv[1], O_RDWR);
+	fd_c = open(argv[1], O_RDWR);
+	if (fd_a == -1 || fd_b == -1 || fd_c == -1) {
+		fprintf(stderr, "open() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	// Switch the device file to retained mode
+	ret = ioctl(fd_a, SET_MINOR_MODE, MINOR_MODE_RETAIN);
+	if (ret == -1) {
+		fprintf(stderr, "ioctl() failed: %s\n", strerror(errno));
+		return(EXIT_FAILURE);
+	}
+
+	// Post the messages
+	for (i = 0; i < MESSAGES; i++) {
+		sprintf(msg, "msg-%d", i);
+		ret = write(fd_a, msg, strlen(msg) + 1);
+		if (ret == -1) {
+			fprintf(stderr, "write() failed\n");
+			return(EXIT_FAILURE);
+		}
+	}
+
+	// Both sessions see every message
+	for (i = 0; i < MESSAGES; i++) {
+		sprintf(msg, "msg-%d", i);
+		if (expect(fd_a, msg) || expect(fd_b, msg)) {
+			return(EXIT_FAILURE);
+		}
+	}
+	printf("independent offsets ok\n");
+
+	// Replay from offset 1
+	ret = ioctl(fd_a, SEEK_OFFSET, 1UL);
+	if (ret == -1 || expect(fd_a, "msg-1")) {
+		fprintf(stderr, "seek failed\n");
+		return(EXIT_FAILURE);
+	}
+	ret = ioctl(fd_a, GET_OFFSET, &offset);
+	if (ret == -1 || offset != 2) {
+		fprintf(stderr, "GET_OFFSET returned %lu - expected 2\n", offset);
+		return(EXIT_FAILURE);
+	}
+	printf("seek ok\n");
+
+	// Sessions in the same group share the offset
+	if (ioctl(fd_b, JOIN_GROUP, "group") == -1 ||
+	    ioctl(fd_c, JOIN_GROUP, "group") == -1) {
+		fprintf(stderr, "JOIN_GROUP failed: %s\n", strerror(errno));
+		return(EXIT_FAILURE);
+	}
+	if (expect(fd_b, "msg-0") || expect(fd_c, "msg-1")) {
+		return(EXIT_FAILURE);
+	}
+	printf("group offset ok\n");
+
+	// Restore the FIFO mode
+	ioctl(fd_a, SET_MINOR_MODE, 0UL);
+
+	return(EXIT_SUCCESS);
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../timed-msg-system.h"
+
+// Execute after sudoing in your shell
+// The test assumes the default max_message_size
+
+#define MINOR 0
+#define MSG_SIZE 4000
+
+int main(int argc, char *argv[])
+{
+	unsigned int major;
+	int ret, fd;
+	char *msg;
+	char buf[MSG_SIZE];
+	struct completion_struct completion;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage:sudo %s <pathname> <major>\n", argv[0]);
+		return(EXIT_FAILURE);
+	}
+
+	major = strtoul(argv[2], NULL, 0);
+
+	// Create a char device file with the given major and 0 with minor number
+	ret = mknod(argv[1], S_IFCHR, makedev(major, MINOR));
+	if (ret == -1) {
+		fprintf(stderr, "mknod() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	// Open the file
+	fd = open(argv[1], O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "open() failed\n");
+		return(EXIT_FAILURE);
+	}
+
+	if (ioctl(fd, SET_ZEROCOPY, 1) == -1) {
+		fprintf(stderr, "ioctl() failed: %s\n", strerror(errno));
+		return(EXIT_FAILURE);
+	}
+
+	// Write a buffer that crosses a page boundary
+	msg = aligned_alloc(4096, 2 * 4096);
+	if (msg == NULL) {
+		fprintf(stderr, "aligned_alloc() failed\n");
+		return(EXIT_FAILURE);
+	}
+	memset(msg + 2048, 'z', MSG_SIZE);
+	ret = write(fd, msg + 2048, MSG_SIZE);
+	if (ret != MSG_SIZE) {
+		fprintf(stderr, "write() returned %d - unexpected\n", ret);
+		return(EXIT_FAILURE);
+	}
+
+	// The buffer is still referenced by the message
+	ret = ioctl(fd, GET_COMPLETION, &completion);
+	if (ret == -1 && errno == ENOMSG) {
+		printf("no completion before read as expected\n");
+	} else {
+		fprintf(stderr, "GET_COMPLETION returned %d - unexpected\n", ret);
+		return(EXIT_FAILURE);
+	}
+
+	ret = read(fd, buf, MSG_SIZE);
+	if (ret != MSG_SIZE || memcmp(buf, msg + 2048, MSG_SIZE)) {
+		fprintf(stderr, "read() returned %d - unexpected\n", ret);
+		return(EXIT_FAILURE);
+	}
+	printf("message read as expected\n");
+
+	// Now the buffer can be reused
+	ret = ioctl(fd, GET_COMPLETION, &completion);
+	if (ret == -1) {
+		fprintf(stderr, "GET_COMPLETION failed: %s\n", strerror(errno));
+		return(EXIT_FAILURE);
+	}
+	if (completion.type != COMPLETION_ZEROCOPY || completion.status != 0 ||
+	    completion.cookie != (unsigned long long)(msg + 2048)) {
+		fprintf(stderr, "unexpected completion\n");
+		return(EXIT_FAILURE);
+	}
+	printf("completion of offset %llu received as expected\n",
+	       completion.offset);
+
+	free(msg);
+	return(EXIT_SUCCESS);
+}
@@ -23,6 +23,7 @@
 #include <linux/errno.h>
 #include <linux/mutex.h>
 #include <linux/list.h>
+#include <linux/plist.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/mm.h>
@@ -30,6 +31,29 @@
 #include <linux/param.h>
 #include <linux/wait.h>
 #include <linux/version.h>
+#include <linux/xarray.h>
+#include <linux/string.h>
+#include <linux/jiffies.h>
+#include <linux/sched.h>
+#include <linux/sched/clock.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/hashtable.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/timer.h>
+#include <linux/poll.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/nodemask.h>
+#include <linux/vmalloc.h>
+#include <linux/lz4.h>
+#include <linux/spinlock.h>
+#include <linux/highmem.h>
+#include <linux/atomic.h>
+#include <linux/eventfd.h>
+#include <linux/signal.h>
 #include "timed-msg-system.h"
 
 /* Parameters reconfigurable by root */
@@ -37,9 +61,28 @@ static unsigned int max_message_size = MAX_MSG_SIZE_DEFAULT;
 module_param(max_message_size, uint, S_IRUGO | S_IWUSR);
 static unsigned int max_storage_size = MAX_STORAGE_SIZE_DEFAULT;
 module_param(max_storage_size, uint, S_IRUGO | S_IWUSR);
+static unsigned int compress_threshold = COMPRESS_THRESHOLD_DEFAULT;
+module_param(compress_threshold, uint, S_IRUGO | S_IWUSR);
+static bool snapshot_delayed = true;
+module_param(snapshot_delayed, bool, S_IRUGO | S_IWUSR);
 
 static int major;
 static struct minor_struct minors[MINORS];
+static struct dentry *debugfs_root;
+/* Runs the delayed posts restored from snapshots, which have no session */
+static struct workqueue_struct *restore_wq;
+/* CLOCK_MONOTONIC time and jiffy sampled together, to map release times */
+static u64 release_ref_ns;
+static u64 release_ref_jiffies;
+/* Correlation IDs of CALL requests, 0 is not used */
+static atomic64_t next_corr_id = ATOMIC64_INIT(0);
+/* Protects the completion queues of sessions and the writers of pinned pages */
+static DEFINE_SPINLOCK(completion_lock);
+
+static void __lowat_timeout(struct timer_list *);
+static void __cork_timeout(struct work_struct *);
+static struct message_struct *__alloc_message(size_t, int);
+static void __awake_pending_reader(struct minor_struct *);
 
 /* Portable minor number retrieval */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
@@ -48,6 +91,228 @@ static struct minor_struct minors[MINORS];
 #define fminor(filep) iminor(filep->f_entry->d_inode)
 #endif
 
+/* Portable timer API */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define timer_delete_sync(timer) del_timer_sync(timer)
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 16, 0)
+#define timer_container_of(var, timer, field) from_timer(var, timer, field)
+#endif
+
+/* Portable page pinning, FOLL_PIN was introduced in 5.6 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+#define pin_user_pages_fast(start, nr_pages, gup_flags, pages) \
+	get_user_pages_fast(start, nr_pages, gup_flags, pages)
+#define unpin_user_page(page) put_page(page)
+#endif
+/* Long-term pins of get_user_pages_fast() are supported since 5.2 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 2, 0)
+#define FOLL_LONGTERM 0
+#endif
+
+/* Portable eventfd signaling, the count argument was dropped in 6.8 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+#define eventfd_add(ctx, n) eventfd_signal(ctx, n)
+#else
+#define eventfd_add(ctx, n) eventfd_signal(ctx)
+#endif
+
+/* Profiling of the minor and session mutexes (make CONFIG_TIMED_MSG_LOCK_STATS=y) */
+#ifdef TIMED_MSG_LOCK_STATS
+/* Sites in order of first acquisition, the last slot collects the others */
+static struct lock_site *lock_sites[LOCK_SITES];
+static int lock_sites_nr;
+static DEFINE_SPINLOCK(lock_sites_lock);
+
+/**
+* __lock_site_id - Index of a lock site in the statistics of device files
+*
+* @site: pointer to the %lock_site
+*
+* NOTE A site gets its index on its first acquisition. Once %LOCK_SITES - 1
+* sites are known, the further ones share the last index
+*/
+static int __lock_site_id(struct lock_site *site)
+{
+	int id;
+
+	id = smp_load_acquire(&(site->id));
+	if (id >= 0) {
+		return id;
+	}
+	spin_lock(&lock_sites_lock);
+	id = site->id;
+	if (id < 0) {
+		id = LOCK_SITES - 1;
+		if (lock_sites_nr < LOCK_SITES - 1) {
+			id = lock_sites_nr++;
+			lock_sites[id] = site;
+		}
+		smp_store_release(&(site->id), id);
+	}
+	spin_unlock(&lock_sites_lock);
+	return id;
+}
+
+/**
+* __lock_stat_max - Raise a maximum kept in an atomic counter
+*
+* @max: pointer to the maximum
+* @value: new sample
+*
+*/
+static void __lock_stat_max(atomic64_t *max, u64 value)
+{
+	s64 old, prev;
+
+	old = atomic64_read(max);
+	while ((s64)value > old) {
+		prev = atomic64_cmpxchg(max, old, value);
+		if (prev == old) {
+			break;
+		}
+		old = prev;
+	}
+}
+
+/**
+* __lock_acquire - Acquire a profiled mutex
+*
+* @mtx: pointer to the mutex
+* @minor: pointer to the %minor_struct the statistics are charged to
+* @hold: pointer to the %lock_hold of @mtx
+* @site: pointer to the %lock_site of the caller
+*
+* NOTE The wait is measured only if the mutex is not free at once
+*/
+static void __lock_acquire(struct mutex *mtx, struct minor_struct *minor,
+			   struct lock_hold *hold, struct lock_site *site)
+{
+	int id;
+	u64 start, wait;
+	struct lock_stat *stat;
+
+	id = __lock_site_id(site);
+	stat = &(minor->lock_stats[id]);
+	if (!mutex_trylock(mtx)) {
+		start = ktime_get_ns();
+		mutex_lock(mtx);
+		wait = ktime_get_ns() - start;
+		atomic64_inc(&(stat->contended));
+		atomic64_add(wait, &(stat->wait_ns));
+		__lock_stat_max(&(stat->max_wait_ns), wait);
+	}
+	atomic64_inc(&(stat->acquired));
+	hold->site = id;
+	hold->since = ktime_get_ns();
+}
+
+/**
+* __lock_release - Release a profiled mutex
+*
+* @mtx: pointer to the mutex
+* @minor: pointer to the %minor_struct the statistics are charged to
+* @hold: pointer to the %lock_hold of @mtx
+*
+* NOTE The hold time is charged to the site that acquired the mutex
+*/
+static void __lock_release(struct mutex *mtx, struct minor_struct *minor,
+			   struct lock_hold *hold)
+{
+	u64 held;
+	struct lock_stat *stat;
+
+	held = ktime_get_ns() - hold->since;
+	stat = &(minor->lock_stats[hold->site]);
+	atomic64_add(held, &(stat->hold_ns));
+	__lock_stat_max(&(stat->max_hold_ns), held);
+	mutex_unlock(mtx);
+}
+
+#define LOCK_SITE(name) \
+	({ static struct lock_site __site = { name, __func__, __LINE__, -1 }; \
+	   &__site; })
+#define minor_lock(minor) \
+	__lock_acquire(&((minor)->mtx), (minor), &((minor)->mtx_hold), \
+		       LOCK_SITE("minor"))
+#define minor_unlock(minor) \
+	__lock_release(&((minor)->mtx), (minor), &((minor)->mtx_hold))
+#define session_lock(session) \
+	__lock_acquire(&((session)->mtx), &(minors[(session)->minor]), \
+		       &((session)->mtx_hold), LOCK_SITE("session"))
+#define session_unlock(session) \
+	__lock_release(&((session)->mtx), &(minors[(session)->minor]), \
+		       &((session)->mtx_hold))
+#else
+#define minor_lock(minor) mutex_lock(&((minor)->mtx))
+#define minor_unlock(minor) mutex_unlock(&((minor)->mtx))
+#define session_lock(session) mutex_lock(&((session)->mtx))
+#define session_unlock(session) mutex_unlock(&((session)->mtx))
+#endif
+
+/**
+* __init_session - Initialize an I/O session with the default settings
+*
+* @session: pointer to %session_struct representing the I/O session
+*
+* NOTE The write workqueue and the device file of @session are set by the
+* caller
+*/
+static void __init_session(struct session_struct *session)
+{
+	mutex_init(&(session->mtx));
+	session->write_timeout = 0;
+	session->read_timeout = 0;
+	session->msg_ttl = 0;
+	session->offset = 0;
+	session->group = NULL;
+	session->lowat_msgs = 1;
+	session->lowat_bytes = 0;
+	session->lowat_latency = 0;
+	session->lowat_expired = 0;
+	session->eventfd = NULL;
+	session->completion_eventfd = NULL;
+	session->busy_poll_us = 0;
+	session->busy_poll_budget = 0;
+	session->read_header = 0;
+	session->strict_read = 0;
+	session->write_header = 0;
+	session->tag_filter = TAG_FILTER_ALL;
+	session->read_prio = READ_PRIO_TASK;
+	session->consumer = 0;
+	session->partitions = 0;
+	session->nr_partitions = 0;
+	INIT_LIST_HEAD(&(session->consumer_list));
+	memset(&(session->rate_limit), 0, sizeof(struct rate_limit_struct));
+	session->rate_limited = 0;
+	session->msg_tokens = 0;
+	session->byte_tokens = 0;
+	session->rate_refill = 0;
+	session->compress_wrkmem = NULL;
+	session->compress_buf = NULL;
+	session->compress_buf_size = 0;
+	session->zerocopy = 0;
+	INIT_LIST_HEAD(&(session->zerocopy_msgs));
+	session->completion_head = 0;
+	session->completion_count = 0;
+	session->completions_lost = 0;
+	session->post_completions = 0;
+	session->deferred_seq = 0;
+	session->write_affinity = WRITE_AFFINITY_NONE;
+	session->write_affinity_target = NUMA_NO_NODE;
+	timer_setup(&(session->lowat_timer), __lowat_timeout, 0);
+	init_waitqueue_head(&(session->poll_wq));
+	mutex_init(&(session->cork_mtx));
+	session->corked = 0;
+	memset(&(session->cork), 0, sizeof(struct cork_struct));
+	INIT_LIST_HEAD(&(session->cork_msgs));
+	session->cork_count = 0;
+	session->cork_bytes = 0;
+	INIT_DELAYED_WORK(&(session->cork_work), __cork_timeout);
+	INIT_LIST_HEAD(&(session->pending_writes));
+	INIT_LIST_HEAD(&(session->list));
+}
+
 static int dev_open(struct inode *inodep, struct file *filep)
 {
 	struct session_struct *session_struct;
@@ -59,414 +324,3907 @@ static int dev_open(struct inode *inodep, struct file *filep)
 		return -ENOMEM;
 	}
 	/* Initialize the session_struct */
-	mutex_init(&(session_struct->mtx));
 	session_struct->write_wq = alloc_workqueue(WRITE_WORK_QUEUE,
 						   WQ_MEM_RECLAIM, 0);
 	if (session_struct->write_wq == NULL) {
 		kfree(session_struct);
 		return -ENOMEM;
 	}
-	session_struct->write_timeout = 0;
-	session_struct->read_timeout = 0;
-	INIT_LIST_HEAD(&(session_struct->pending_writes));
-	INIT_LIST_HEAD(&(session_struct->list));
+	__init_session(session_struct);
 	/* Link the session_struct to the struct file */
 	filep->private_data = (void *)session_struct;
 	/* Link the session_struct to the minor_struct */
 	minor_idx = iminor(inodep);
-	mutex_lock(&(minors[minor_idx].mtx));
+	session_struct->minor = minor_idx;
+	minor_lock(&(minors[minor_idx]));
 	list_add_tail(&(session_struct->list), &(minors[minor_idx].sessions));
-	mutex_unlock(&(minors[minor_idx].mtx));
+	minor_unlock(&(minors[minor_idx]));
 	return 0;
 }
 
-static ssize_t dev_read(struct file *filep, char *bufp, size_t len,
-			loff_t * offp)
+/**
+* __read_offset - Retrieve the read offset used by an I/O session
+*
+* @session: pointer to %struct session_struct representing the I/O session
+*
+* Returns a pointer to the offset of the group joined by the session, if any,
+* or to the private offset of the session
+*
+* NOTE The offsets are protected by the mutex of the device file
+*/
+static unsigned long *__read_offset(struct session_struct *session)
+{
+	if (session->group) {
+		return &(session->group->offset);
+	}
+	return &(session->offset);
+}
+
+/**
+* __head_offset - Offset of the oldest message stored in a device file
+*
+* @minor: pointer to %minor_struct representing the device file
+*
+*/
+static unsigned long __head_offset(struct minor_struct *minor)
 {
-	int minor_idx, ret;
 	struct message_struct *msg;
-	struct session_struct *session;
-	struct pending_read_struct *pending_read;
-	unsigned long read_timeout, to_sleep;
 
-	session = (struct session_struct *)filep->private_data;
-	minor_idx = fminor(filep);
+	msg = list_first_entry_or_null(&(minor->fifo), struct message_struct,
+				       list);
+	if (msg == NULL) {
+		return minor->next_offset;
+	}
+	return msg->offset;
+}
 
-	mutex_lock(&(minors[minor_idx].mtx));
+/**
+* __unlink_message - Remove a message from a device file
+*
+* @minor: pointer to %minor_struct representing the device file
+* @msg: pointer to the %message_struct to remove
+*
+*/
+static void __unlink_message(struct minor_struct *minor,
+			     struct message_struct *msg)
+{
+	list_del(&(msg->list));
+	if (msg->ttl) {
+		list_del(&(msg->expiry));
+	}
+	if (!hlist_unhashed(&(msg->key_node))) {
+		hash_del(&(msg->key_node));
+	}
+	list_del(&(msg->tag_list));
+	minor->tag_count[msg->tag]--;
+	minor->tag_bytes[msg->tag] -= msg->size;
+	if (minor->mode & MINOR_MODE_PARTITION) {
+		list_del(&(msg->partition_list));
+		minor->partition_count[msg->partition]--;
+		minor->partition_bytes[msg->partition] -= msg->size;
+	}
+	if (minor->mode & MINOR_MODE_RETAIN) {
+		xa_erase(&(minor->log), msg->offset);
+		xa_erase(&(minor->tag_log[msg->tag]), msg->offset);
+	}
+	minor->current_size -= msg->size;
+	WRITE_ONCE(minor->msg_count, minor->msg_count - 1);
+}
 
-	/* Retrieve the first message stored in the device file */
-	msg = list_first_entry_or_null(&(minors[minor_idx].fifo),
-				       struct message_struct, list);
+/**
+* __push_completion - Queue a completion to a session
+*
+* @session: pointer to the %session_struct to notify
+* @type: %COMPLETION_* type of the completion
+* @status: outcome of the operation
+* @cookie: identifier of the operation
+* @offset: offset of the message involved
+*
+* NOTE Must be called with %completion_lock held. If the queue is full, the
+* completion is lost and counted. Pollers of the session are woken up
+*/
+static void __push_completion(struct session_struct *session,
+			      unsigned int type, int status,
+			      unsigned long long cookie,
+			      unsigned long long offset)
+{
+	struct completion_struct *completion;
 
-	if (msg != NULL) {	/* Not empty queue */
-		goto deliver_message;
+	if (session->completion_count == COMPLETION_RING) {
+		session->completions_lost++;
+		return;
+	}
+	completion = &(session->completions[(session->completion_head +
+					     session->completion_count) %
+					    COMPLETION_RING]);
+	completion->type = type;
+	completion->status = status;
+	completion->cookie = cookie;
+	completion->offset = offset;
+	session->completion_count++;
+	wake_up_interruptible(&(session->poll_wq));
+	if (session->completion_eventfd != NULL) {
+		eventfd_add(session->completion_eventfd, 1);
 	}
+}
 
-	/* Empty queue */
-	mutex_unlock(&(minors[minor_idx].mtx));
-	mutex_lock(&(session->mtx));
-	read_timeout = session->read_timeout;
-	mutex_unlock(&(session->mtx));
-	if (!read_timeout) {	/* Non-blocking read */
-		return -ENOMSG;
+/**
+* __release_pinned - Release the writer pages referenced by a message
+*
+* @zc: pointer to the %zerocopy_struct of the message
+* @offset: offset of the message
+*
+* NOTE The writer, if still there, gets a %COMPLETION_ZEROCOPY completion
+*/
+static void __release_pinned(struct zerocopy_struct *zc, unsigned long offset)
+{
+	unsigned int i;
+
+	for (i = 0; i < zc->nr_pages; i++) {
+		unpin_user_page(zc->pages[i]);
+	}
+	spin_lock(&completion_lock);
+	if (zc->session != NULL) {
+		list_del(&(zc->list));
+		__push_completion(zc->session, COMPLETION_ZEROCOPY, zc->status,
+				  zc->cookie, offset);
 	}
+	spin_unlock(&completion_lock);
+	kvfree(zc->pages);
+	kfree(zc);
+}
 
-	/* Blocking read */
-	to_sleep = read_timeout;
-	/* Allocate a pending_read_struct */
-	pending_read = kmalloc(sizeof(struct pending_read_struct), GFP_KERNEL);
-	if (pending_read == NULL) {
-		return -ENOMEM;
+/**
+* __free_message - Deallocate a message no longer linked to a device file
+*
+* @msg: pointer to the %message_struct to deallocate
+*
+*/
+static void __free_message(struct message_struct *msg)
+{
+	if (msg->zc != NULL) {
+		__release_pinned(msg->zc, msg->offset);
 	}
-	/* Initialize the pending_read_struct */
-	pending_read->msg_available = 0;
-	pending_read->flushing = 0;
-	INIT_LIST_HEAD(&(pending_read->list));
-	mutex_lock(&(minors[minor_idx].mtx));
-	/* Enqueue the pending read to the others */
-	list_add_tail(&(pending_read->list),
-		      &(minors[minor_idx].pending_reads));
-	mutex_unlock(&(minors[minor_idx].mtx));
+	kfree(msg->buf);
+	kfree(msg);
+}
 
-	/* Go to sleep waiting for available messages */
-	while (to_sleep) {
-		ret =
-		    wait_event_interruptible_timeout(minors[minor_idx].read_wq,
-						     pending_read->msg_available
-						     || pending_read->flushing,
-						     to_sleep);
-		if (ret == -ERESTARTSYS) {	/* signal delivered during sleep */
-			if (pending_read->msg_available
-			    || pending_read->flushing) {
-				goto free_pending_read;
-			} else {
-				goto remove_pending_read;
-			}
+/**
+* __message_expired - Check if the time to live of a message is over
+*
+* @msg: pointer to the %message_struct to check
+*
+*/
+static int __message_expired(struct message_struct *msg)
+{
+	return msg->ttl && time_after_eq(jiffies, msg->expires);
+}
+
+/**
+* __tag_matches - Check if a message passes the tag filter of a session
+*
+* @session: pointer to %session_struct representing the I/O session
+* @msg: pointer to the %message_struct to check
+*
+*/
+static int __tag_matches(struct session_struct *session,
+			 struct message_struct *msg)
+{
+	return !!(session->tag_filter & (1ULL << msg->tag));
+}
+
+/**
+* __first_partitioned - Oldest message of the partitions owned by a session
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+*
+* Returns the message or NULL if no message of the partitions of the
+* session is stored
+*
+* NOTE Only the heads of the sublists of the owned partitions are compared.
+* The tag filter does not apply: a consumer reads whatever its partitions hold
+*/
+static struct message_struct *__first_partitioned(struct minor_struct *minor,
+						  struct session_struct
+						  *session)
+{
+	unsigned int partition, owned;
+	struct message_struct *msg;
+	struct message_struct *first = NULL;
+
+	owned = session->partitions;
+	while (owned) {
+		partition = __ffs(owned);
+		owned &= owned - 1;
+		msg = list_first_entry_or_null(&(minor->partitions[partition]),
+					       struct message_struct,
+					       partition_list);
+		if (msg != NULL
+		    && (first == NULL || msg->offset < first->offset)) {
+			first = msg;
 		}
-		if (ret == 0) {	/* empty list after timer expiration */
-			ret = -ETIME;
-			goto remove_pending_read;
+	}
+	return first;
+}
+
+/**
+* __first_message - Oldest message matching the tag filter of a session
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+*
+* Returns the message or NULL if no matching message is stored
+*
+* NOTE Only the heads of the sublists of the filtered tags are compared, so
+* that the cost does not depend on the number of stored messages
+*/
+static struct message_struct *__first_message(struct minor_struct *minor,
+					      struct session_struct *session)
+{
+	unsigned int tag;
+	unsigned long long filter;
+	struct message_struct *msg;
+	struct message_struct *first = NULL;
+
+	if (minor->mode & MINOR_MODE_PARTITION) {
+		return __first_partitioned(minor, session);
+	}
+	filter = session->tag_filter;
+	if (filter == TAG_FILTER_ALL) {
+		return list_first_entry_or_null(&(minor->fifo),
+						struct message_struct, list);
+	}
+	while (filter) {
+		tag = __ffs64(filter);
+		filter &= filter - 1;
+		msg = list_first_entry_or_null(&(minor->tags[tag]),
+					       struct message_struct, tag_list);
+		if (msg != NULL
+		    && (first == NULL || msg->offset < first->offset)) {
+			first = msg;
 		}
-		if (pending_read->flushing) {	/* dev_flush() invoked */
-			ret = -ECANCELED;
-			goto free_pending_read;
+	}
+	return first;
+}
+
+/**
+* __first_retained - First retained message matching the tag filter of a
+* session from its read offset
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+* @filter: tag filter of the session
+*
+* Returns the message or NULL if no matching message is retained
+*
+* NOTE The per-tag logs of the filtered tags are searched from the read
+* offset, so that non-matching messages are never scanned
+*/
+static struct message_struct *__first_retained(struct minor_struct *minor,
+					       struct session_struct *session,
+					       unsigned long long filter)
+{
+	unsigned int tag;
+	unsigned long index;
+	struct message_struct *msg;
+	struct message_struct *first = NULL;
+
+	if (filter == TAG_FILTER_ALL) {
+		index = *__read_offset(session);
+		return xa_find(&(minor->log), &index, ULONG_MAX, XA_PRESENT);
+	}
+	while (filter) {
+		tag = __ffs64(filter);
+		filter &= filter - 1;
+		index = *__read_offset(session);
+		msg = xa_find(&(minor->tag_log[tag]), &index, ULONG_MAX,
+			      XA_PRESENT);
+		if (msg != NULL
+		    && (first == NULL || msg->offset < first->offset)) {
+			first = msg;
 		}
-		/* A message should be available */
+	}
+	return first;
+}
 
-		/* Check if the list is actually not empty */
-		mutex_lock(&(minors[minor_idx].mtx));
-		msg = list_first_entry_or_null(&(minors[minor_idx].fifo),
-					       struct message_struct, list);
-		if (msg == NULL) {	/* list actually empty, return to sleep */
-			pending_read->msg_available = 0;
-			list_add_tail(&(pending_read->list),
-				      &(minors[minor_idx].pending_reads));
-			mutex_unlock(&(minors[minor_idx].mtx));
-			to_sleep = ret;
-		} else {	/* message actually available */
-			kfree(pending_read);
-			goto deliver_message;
+/**
+* __next_message - Retrieve the next message to be delivered to a session
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+*
+* Returns the message or NULL if no message is available for the session
+*
+* NOTE Expired messages met along the way are removed from the device file
+*/
+static struct message_struct *__next_message(struct minor_struct *minor,
+					     struct session_struct *session)
+{
+	struct message_struct *msg;
+
+	while (1) {
+		if (minor->mode & MINOR_MODE_RETAIN) {
+			/* Expired messages may leave holes in the log */
+			msg = __first_retained(minor, session,
+					       session->tag_filter);
+		} else {
+			msg = __first_message(minor, session);
+		}
+		if (msg == NULL || !__message_expired(msg)) {
+			return msg;
 		}
+		__unlink_message(minor, msg);
+		__free_message(msg);
+		minor->expired_on_read++;
 	}
+}
 
- deliver_message:
-	if (len > msg->size) {
-		len = msg->size;
+/**
+* __queued_retained - Number of retained messages after the read offset of a
+* session
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+*
+* NOTE Messages of a tag are numbered by %tag_seq, so each filtered tag costs
+* one lookup in its log. Holes left by messages expired in the middle of the
+* log are counted until a reader meets them
+*/
+static unsigned long __queued_retained(struct minor_struct *minor,
+				       struct session_struct *session)
+{
+	unsigned int tag;
+	unsigned long index, count = 0;
+	unsigned long long filter;
+	struct message_struct *msg;
+
+	filter = session->tag_filter;
+	if (filter == TAG_FILTER_ALL) {
+		index = max(*__read_offset(session), __head_offset(minor));
+		return minor->next_offset - index;
 	}
-	if (copy_to_user(bufp, msg->buf, len)) {
-		mutex_unlock(&(minors[minor_idx].mtx));
-		return -EFAULT;
+	while (filter) {
+		tag = __ffs64(filter);
+		filter &= filter - 1;
+		index = *__read_offset(session);
+		msg = xa_find(&(minor->tag_log[tag]), &index, ULONG_MAX,
+			      XA_PRESENT);
+		if (msg != NULL) {
+			count += minor->tag_posted[tag] - msg->tag_seq;
+		}
 	}
-	list_del(&(msg->list));
-	minors[minor_idx].current_size -= msg->size;
-	mutex_unlock(&(minors[minor_idx].mtx));
-	kfree(msg->buf);
-	kfree(msg);
-	return len;
- remove_pending_read:
-	mutex_lock(&(minors[minor_idx].mtx));
-	list_del(&(pending_read->list));
-	mutex_unlock(&(minors[minor_idx].mtx));
- free_pending_read:
-	kfree(pending_read);
-	return ret;
+	return count;
 }
 
 /**
-* __post_message - Actually write a message into a device file
-* 
-* @minor: pointer to %minor_struct representing the target device file
-* @kbuf: pointer to the kernel buffer containing the message to be posted
-* @len: size of the message
+* __queued_messages - Number of messages waiting to be read by a session
 *
-* Returns the number of written bytes on success. Otherwise, it returns
-* %-ENOSPC if the device file has no free space or %-ENOMEM if it fails in
-* allocating the %message_struct to post
-* */
-static int __post_message(struct minor_struct *minor, char *kbuf, size_t len)
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+*
+* NOTE In partitioned mode the tag filter does not apply
+*/
+static unsigned long __queued_messages(struct minor_struct *minor,
+				       struct session_struct *session)
 {
-	struct message_struct *msg;
+	unsigned int tag, partition, owned;
+	unsigned long count = 0;
+	unsigned long long filter;
 
-	if (minor->current_size + len > max_storage_size) {
-		kfree(kbuf);
-		return -ENOSPC;
+	if (minor->mode & MINOR_MODE_PARTITION) {
+		owned = session->partitions;
+		while (owned) {
+			partition = __ffs(owned);
+			owned &= owned - 1;
+			count += minor->partition_count[partition];
+		}
+		return count;
 	}
-	msg = kmalloc(sizeof(struct message_struct), GFP_KERNEL);
-	if (msg == NULL) {
-		kfree(kbuf);
-		return -ENOMEM;
+	if (!(minor->mode & MINOR_MODE_RETAIN)) {
+		filter = session->tag_filter;
+		if (filter == TAG_FILTER_ALL) {
+			return minor->msg_count;
+		}
+		while (filter) {
+			tag = __ffs64(filter);
+			filter &= filter - 1;
+			count += minor->tag_count[tag];
+		}
+		return count;
 	}
-	msg->size = len;
-	msg->buf = kbuf;
-	INIT_LIST_HEAD(&(msg->list));
-	list_add_tail(&(msg->list), &(minor->fifo));
-	minor->current_size += len;
+	return __queued_retained(minor, session);
+}
 
-	return len;
+/**
+* __queued_bytes - Stored bytes waiting to be read by a session
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+*
+* NOTE Not meaningful in retained mode, where read messages are not removed
+*/
+static unsigned long __queued_bytes(struct minor_struct *minor,
+				    struct session_struct *session)
+{
+	unsigned int tag, partition, owned;
+	unsigned long bytes = 0;
+	unsigned long long filter;
+
+	if (minor->mode & MINOR_MODE_PARTITION) {
+		owned = session->partitions;
+		while (owned) {
+			partition = __ffs(owned);
+			owned &= owned - 1;
+			bytes += minor->partition_bytes[partition];
+		}
+		return bytes;
+	}
+	filter = session->tag_filter;
+	if (filter == TAG_FILTER_ALL) {
+		return minor->current_size;
+	}
+	while (filter) {
+		tag = __ffs64(filter);
+		filter &= filter - 1;
+		bytes += minor->tag_bytes[tag];
+	}
+	return bytes;
+}
+
+/**
+* __lowat_reached - Check the low watermark of a session
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+*
+* Returns non-zero if at least %lowat_msgs messages or %lowat_bytes bytes
+* are waiting to be read
+*
+* NOTE The low watermark is read without holding the mutex of the session.
+* In retained mode only %lowat_msgs applies
+*/
+static int __lowat_reached(struct minor_struct *minor,
+			   struct session_struct *session)
+{
+	unsigned int lowat_bytes;
+
+	if (__queued_messages(minor, session) >= READ_ONCE(session->lowat_msgs)) {
+		return 1;
+	}
+	lowat_bytes = READ_ONCE(session->lowat_bytes);
+	if (lowat_bytes == 0 || (minor->mode & MINOR_MODE_RETAIN)) {
+		return 0;
+	}
+	return __queued_bytes(minor, session) >= lowat_bytes;
+}
+
+/**
+* __arm_lowat_timer - Start the max-latency timer of a session
+*
+* @session: pointer to %session_struct representing the I/O session
+*
+* NOTE The timer is not restarted if already pending, so that the latency is
+* bounded since the first message that did not reach the low watermark
+*/
+static void __arm_lowat_timer(struct session_struct *session)
+{
+	unsigned long lowat_latency;
+
+	lowat_latency = READ_ONCE(session->lowat_latency);
+	if (lowat_latency && !timer_pending(&(session->lowat_timer))) {
+		mod_timer(&(session->lowat_timer), jiffies + lowat_latency);
+	}
+}
+
+/**
+* __lowat_timeout - Awake the readers of a session after its max latency
+*
+* @timer: pointer to the %lowat_timer of the session
+*
+*/
+static void __lowat_timeout(struct timer_list *timer)
+{
+	struct session_struct *session;
+
+	session = timer_container_of(session, timer, lowat_timer);
+	WRITE_ONCE(session->lowat_expired, 1);
+	wake_up_interruptible(&(minors[session->minor].read_wq));
+	wake_up_interruptible(&(session->poll_wq));
+}
+
+/**
+* __read_priority - Priority of a reader blocking along a session
+*
+* @session: pointer to %session_struct representing the I/O session
+*
+* Returns the priority set with %SET_READ_PRIORITY or, by default, the
+* priority of the current task. Lower values are served first
+*/
+static int __read_priority(struct session_struct *session)
+{
+	int prio;
+
+	prio = READ_ONCE(session->read_prio);
+	if (prio == READ_PRIO_TASK) {
+		return current->prio;
+	}
+	return prio;
+}
+
+/**
+* __busy_poll - Spin waiting for a message before going to sleep
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+* @seen: %next_offset of the device file when it was found empty
+* @budget: maximum spinning time in microseconds
+*
+* Returns the message to deliver, with the mutex of the device file held,
+* or NULL (mutex released) if no message was posted while spinning
+*
+* NOTE The spinning reader only loads %next_offset: the mutex is not taken
+* unless a message was posted, so that misses do not delay writers
+*
+* NOTE The spinning time is adapted to the recent outcomes: it is doubled
+* after a hit (up to %busy_poll_us) and halved after a miss (down to
+* %busy_poll_us / %BUSY_POLL_MIN_DIVISOR, so that it can grow again)
+*/
+static struct message_struct *__busy_poll(struct minor_struct *minor,
+					  struct session_struct *session,
+					  unsigned long seen,
+					  unsigned int budget)
+{
+	u64 deadline;
+	unsigned int busy_poll_us;
+	struct message_struct *msg;
+
+	deadline = local_clock() + (u64)budget * NSEC_PER_USEC;
+	while (READ_ONCE(minor->next_offset) == seen) {
+		if (need_resched() || signal_pending(current)
+		    || local_clock() >= deadline) {
+			break;
+		}
+		cpu_relax();
+	}
+
+	busy_poll_us = READ_ONCE(session->busy_poll_us);
+	msg = NULL;
+	if (READ_ONCE(minor->next_offset) != seen) {
+		minor_lock(minor);
+		msg = __next_message(minor, session);
+		if (msg != NULL) {
+			atomic_long_inc(&(minor->busy_poll_hits));
+			WRITE_ONCE(session->busy_poll_budget,
+				   min(budget * 2, busy_poll_us));
+			return msg;
+		}
+		minor_unlock(minor);
+	}
+	atomic_long_inc(&(minor->busy_poll_misses));
+	WRITE_ONCE(session->busy_poll_budget,
+		   max(budget / 2,
+		       DIV_ROUND_UP(busy_poll_us, BUSY_POLL_MIN_DIVISOR)));
+	return NULL;
+}
+
+/**
+* __copy_compressed - Decompress the payload of a message in a user buffer
+*
+* @msg: pointer to the compressed %message_struct to deliver
+* @bufp: user buffer
+* @len: number of payload bytes to deliver (at most %raw_size)
+* @header_len: number of header bytes already copied
+*
+* Returns the number of copied bytes, including the header, %-ENOMEM,
+* %-EIO if the payload is corrupted or %-EFAULT if the buffer is illegal
+*
+* NOTE Only the first @len bytes are decompressed when the buffer is short
+*/
+static ssize_t __copy_compressed(struct message_struct *msg,
+				 char __user *bufp, size_t len,
+				 size_t header_len)
+{
+	int ret;
+	char *kbuf;
+
+	if (len == 0) {
+		return header_len;
+	}
+	kbuf = kvmalloc(len, GFP_KERNEL);
+	if (kbuf == NULL) {
+		return -ENOMEM;
+	}
+	ret = LZ4_decompress_safe_partial(msg->buf, kbuf, msg->size, len, len);
+	if (ret < (int)len) {
+		kvfree(kbuf);
+		return -EIO;
+	}
+	if (copy_to_user(bufp, kbuf, len)) {
+		kvfree(kbuf);
+		return -EFAULT;
+	}
+	kvfree(kbuf);
+	return header_len + len;
+}
+
+/**
+* __copy_pinned - Copy a payload from the pinned writer pages to a user buffer
+*
+* @zc: pointer to the %zerocopy_struct of the message to deliver
+* @bufp: user buffer
+* @len: number of payload bytes to deliver
+* @header_len: number of header bytes already copied
+*
+* Returns the number of copied bytes, including the header, or %-EFAULT if
+* the buffer is illegal
+*/
+static ssize_t __copy_pinned(struct zerocopy_struct *zc, char __user *bufp,
+			     size_t len, size_t header_len)
+{
+	unsigned int i, chunk, page_offset;
+	unsigned long left;
+	size_t copied = 0;
+	char *vaddr;
+
+	page_offset = zc->first_offset;
+	for (i = 0; copied < len; i++) {
+		chunk = min_t(size_t, PAGE_SIZE - page_offset, len - copied);
+		vaddr = kmap(zc->pages[i]);
+		left = copy_to_user(bufp + copied, vaddr + page_offset, chunk);
+		kunmap(zc->pages[i]);
+		if (left) {
+			return -EFAULT;
+		}
+		copied += chunk;
+		page_offset = 0;
+	}
+	return header_len + len;
+}
+
+/**
+* __copy_message - Copy a message to a user buffer
+*
+* @session: pointer to %session_struct representing the I/O session
+* @msg: pointer to the %message_struct to deliver
+* @bufp: user buffer
+* @len: buffer size
+*
+* Returns the number of copied bytes, including the %read_header_struct if
+* the session requested it, %-EINVAL if the buffer cannot hold the header or
+* %-EFAULT if the buffer is illegal
+*/
+static ssize_t __copy_message(struct session_struct *session,
+			      struct message_struct *msg, char __user *bufp,
+			      size_t len)
+{
+	size_t header_len = 0;
+	struct read_header_struct header;
+
+	if (READ_ONCE(session->read_header)) {
+		if (len < sizeof(struct read_header_struct)) {
+			return -EINVAL;
+		}
+		memset(&header, 0, sizeof(struct read_header_struct));
+		header.posted = ktime_to_ns(msg->posted);
+		header.scheduled = ktime_to_ns(msg->scheduled);
+		header.offset = msg->offset;
+		header.key = msg->key;
+		header.tag = msg->tag;
+		header.corr_id = msg->corr_id;
+		header.size = msg->raw_size;
+		header_len = sizeof(struct read_header_struct);
+		if (copy_to_user(bufp, &header, header_len)) {
+			return -EFAULT;
+		}
+		bufp += header_len;
+		len -= header_len;
+	}
+	if (len > msg->raw_size) {
+		len = msg->raw_size;
+	}
+	if (msg->raw_size != msg->size) {	/* compressed payload */
+		return __copy_compressed(msg, bufp, len, header_len);
+	}
+	if (msg->zc != NULL) {	/* pinned payload */
+		return __copy_pinned(msg->zc, bufp, len, header_len);
+	}
+	if (copy_to_user(bufp, msg->buf, len)) {
+		return -EFAULT;
+	}
+	return header_len + len;
+}
+
+/**
+* __record_latency - Account the queueing delay of a delivered message
+*
+* @minor: pointer to %minor_struct representing the device file
+* @msg: pointer to the delivered %message_struct
+*
+* NOTE Bucket i of the histogram counts delays in [2^i, 2^(i+1)) nanoseconds
+*/
+static void __record_latency(struct minor_struct *minor,
+			     struct message_struct *msg)
+{
+	s64 delay;
+
+	delay = ktime_to_ns(ktime_sub(ktime_get(), msg->posted));
+	if (delay <= 0) {
+		minor->latency_hist[0]++;
+		return;
+	}
+	minor->latency_hist[ilog2(delay)]++;
+}
+
+/**
+* __read_len - Bytes needed to read a message without truncating it
+*
+* @session: pointer to %session_struct representing the I/O session
+* @msg: pointer to the %message_struct to deliver
+*
+*/
+static size_t __read_len(struct session_struct *session,
+			 struct message_struct *msg)
+{
+	if (READ_ONCE(session->read_header)) {
+		return sizeof(struct read_header_struct) + msg->raw_size;
+	}
+	return msg->raw_size;
+}
+
+/**
+* __clone_message - Copy a stored message, detached from its device file
+*
+* @msg: pointer to the %message_struct to copy, whose payload is not pinned
+*
+* Returns the copy or NULL
+*/
+static struct message_struct *__clone_message(struct message_struct *msg)
+{
+	struct message_struct *clone;
+
+	clone = __alloc_message(msg->size, NUMA_NO_NODE);
+	if (clone == NULL) {
+		return NULL;
+	}
+	clone->buf = kmemdup(msg->buf, msg->size, GFP_KERNEL);
+	if (clone->buf == NULL) {
+		kfree(clone);
+		return NULL;
+	}
+	clone->raw_size = msg->raw_size;
+	clone->offset = msg->offset;
+	clone->posted = msg->posted;
+	clone->scheduled = msg->scheduled;
+	clone->keyed = msg->keyed;
+	clone->key = msg->key;
+	clone->tag = msg->tag;
+	clone->corr_id = msg->corr_id;
+	return clone;
+}
+
+/**
+* __read_compressed - Deliver a compressed message out of the mutex
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+* @msg: pointer to the compressed %message_struct to deliver
+* @bufp: user buffer
+* @len: buffer size
+*
+* Returns the outcome of __copy_message(), or %-ENOMEM
+*
+* NOTE Called with the mutex of @minor held. The message is consumed first
+* (removed, or copied and skipped in retained mode) and the mutex is released
+* before decompressing it, so that other readers and writers do not wait for
+* LZ4. Hence the message is lost if the buffer turns out to be illegal
+*/
+static ssize_t __read_compressed(struct minor_struct *minor,
+				 struct session_struct *session,
+				 struct message_struct *msg,
+				 char __user *bufp, size_t len)
+{
+	ssize_t copied;
+
+	if (READ_ONCE(session->read_header)
+	    && len < sizeof(struct read_header_struct)) {
+		minor_unlock(minor);
+		return -EINVAL;
+	}
+	if (minor->mode & MINOR_MODE_RETAIN) {
+		/* The stored message may be dropped once the mutex is released */
+		msg = __clone_message(msg);
+		if (msg == NULL) {
+			minor_unlock(minor);
+			return -ENOMEM;
+		}
+		*__read_offset(session) = msg->offset + 1;
+	} else {
+		__unlink_message(minor, msg);
+	}
+	__record_latency(minor, msg);
+	minor_unlock(minor);
+	copied = __copy_message(session, msg, bufp, len);
+	__free_message(msg);
+	return copied;
+}
+
+/**
+* __peek_message - Copy the next message of a session without removing it
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+* @bufp: user buffer, NULL to get the size of the payload only
+* @len: buffer size
+* @size: where the size of the payload is stored, may be NULL
+*
+* Returns the number of copied bytes as __copy_message(), or the size of the
+* payload if @bufp is NULL, %-ENOMSG if no message is available or %-EINVAL
+* along a session that cannot read the device file
+*
+* NOTE Peeking never blocks and is not a delivery: the read offset, the
+* latency histogram and the status of pinned pages are unchanged
+*/
+static long __peek_message(struct minor_struct *minor,
+			   struct session_struct *session, char __user *bufp,
+			   size_t len, unsigned int *size)
+{
+	long ret;
+	struct message_struct *msg;
+
+	if ((READ_ONCE(minor->mode) & MINOR_MODE_PARTITION)
+	    && !READ_ONCE(session->consumer)) {
+		return -EINVAL;
+	}
+	if (!READ_ONCE(minor->msg_count)) {
+		return -ENOMSG;
+	}
+	minor_lock(minor);
+	msg = __next_message(minor, session);
+	if (msg == NULL) {
+		minor_unlock(minor);
+		return -ENOMSG;
+	}
+	if (size != NULL) {
+		*size = msg->raw_size;
+	}
+	ret = msg->raw_size;
+	if (bufp == NULL) {
+		minor_unlock(minor);
+		return ret;
+	}
+	if (msg->raw_size != msg->size) {
+		/* Decompressed out of the mutex, as dev_read() does */
+		msg = __clone_message(msg);
+		minor_unlock(minor);
+		if (msg == NULL) {
+			return -ENOMEM;
+		}
+		ret = __copy_message(session, msg, bufp, len);
+		__free_message(msg);
+		return ret;
+	}
+	ret = __copy_message(session, msg, bufp, len);
+	minor_unlock(minor);
+	return ret;
+}
+
+static ssize_t dev_read(struct file *filep, char *bufp, size_t len,
+			loff_t * offp)
+{
+	int minor_idx, ret;
+	ssize_t copied;
+	struct message_struct *msg;
+	struct session_struct *session;
+	struct pending_read_struct *pending_read;
+	unsigned long read_timeout, to_sleep, seen;
+	unsigned int busy_poll_budget;
+
+	session = (struct session_struct *)filep->private_data;
+	minor_idx = fminor(filep);
+
+	/* Partitions are owned by consumers only */
+	if ((READ_ONCE(minors[minor_idx].mode) & MINOR_MODE_PARTITION)
+	    && !READ_ONCE(session->consumer)) {
+		return -EINVAL;
+	}
+
+	/* Nothing is stored: the queue is found empty without locking */
+	if (!READ_ONCE(minors[minor_idx].msg_count)) {
+		seen = READ_ONCE(minors[minor_idx].next_offset);
+		goto empty_queue;
+	}
+
+	minor_lock(&(minors[minor_idx]));
+
+	/* Retrieve the next message to be delivered to the session */
+	msg = __next_message(&(minors[minor_idx]), session);
+
+	if (msg != NULL) {	/* Not empty queue */
+		goto deliver_message;
+	}
+
+	seen = minors[minor_idx].next_offset;
+	minor_unlock(&(minors[minor_idx]));
+
+ empty_queue:
+	/* The session settings are single words, read without locking */
+	read_timeout = READ_ONCE(session->read_timeout);
+	busy_poll_budget = READ_ONCE(session->busy_poll_budget);
+	if (!read_timeout) {	/* Non-blocking read */
+		return -ENOMSG;
+	}
+
+	/* Spin for a while, the sleep/wake round-trip may cost more */
+	if (busy_poll_budget) {
+		msg = __busy_poll(&(minors[minor_idx]), session, seen,
+				  busy_poll_budget);
+		if (msg != NULL) {
+			goto deliver_message;
+		}
+	}
+
+	/* Blocking read */
+	to_sleep = read_timeout;
+	/* Allocate a pending_read_struct */
+	pending_read = kmalloc(sizeof(struct pending_read_struct), GFP_KERNEL);
+	if (pending_read == NULL) {
+		return -ENOMEM;
+	}
+	/* Initialize the pending_read_struct */
+	pending_read->msg_available = 0;
+	pending_read->flushing = 0;
+	pending_read->session = session;
+	plist_node_init(&(pending_read->list), __read_priority(session));
+	minor_lock(&(minors[minor_idx]));
+	/* A message may have been posted since the queue was found empty */
+	msg = __next_message(&(minors[minor_idx]), session);
+	if (msg != NULL) {
+		kfree(pending_read);
+		goto deliver_message;
+	}
+	/* Enqueue the pending read to the others */
+	plist_add(&(pending_read->list), &(minors[minor_idx].pending_reads));
+	minor_unlock(&(minors[minor_idx]));
+
+	/* Go to sleep waiting for available messages */
+	while (to_sleep) {
+		ret =
+		    wait_event_interruptible_timeout(minors[minor_idx].read_wq,
+						     pending_read->msg_available
+						     || pending_read->flushing
+						     ||
+						     READ_ONCE(session->
+							       lowat_expired),
+						     to_sleep);
+		if (ret == -ERESTARTSYS) {	/* signal delivered during sleep */
+			goto remove_pending_read;
+		}
+		if (pending_read->flushing) {	/* dev_flush() invoked */
+			ret = -ECANCELED;
+			goto remove_pending_read;
+		}
+		/* A message should be available, or a timer expired */
+
+		/* Check if the list is actually not empty */
+		minor_lock(&(minors[minor_idx]));
+		msg = __next_message(&(minors[minor_idx]), session);
+		if (msg != NULL) {	/* message actually available */
+			if (!plist_node_empty(&(pending_read->list))) {
+				plist_del(&(pending_read->list),
+					  &(minors[minor_idx].pending_reads));
+			}
+			kfree(pending_read);
+			goto deliver_message;
+		}
+		if (ret == 0) {	/* empty list after timer expiration */
+			minor_unlock(&(minors[minor_idx]));
+			ret = -ETIME;
+			goto remove_pending_read;
+		}
+		/* list actually empty, return to sleep */
+		pending_read->msg_available = 0;
+		WRITE_ONCE(session->lowat_expired, 0);
+		if (plist_node_empty(&(pending_read->list))) {
+			/* The priority of the task may have changed */
+			plist_node_init(&(pending_read->list),
+					__read_priority(session));
+			plist_add(&(pending_read->list),
+				  &(minors[minor_idx].pending_reads));
+		}
+		minor_unlock(&(minors[minor_idx]));
+		to_sleep = ret;
+	}
+
+ deliver_message:
+	WRITE_ONCE(session->lowat_expired, 0);
+	/* The message stays queued, its size can be peeked */
+	if (READ_ONCE(session->strict_read) && len < __read_len(session, msg)) {
+		/* This reader may have been awaken for it, pass it on */
+		if (!(minors[minor_idx].mode & MINOR_MODE_RETAIN)) {
+			__awake_pending_reader(&(minors[minor_idx]));
+		}
+		minor_unlock(&(minors[minor_idx]));
+		return -EMSGSIZE;
+	}
+	if (msg->raw_size != msg->size) {	/* compressed payload */
+		return __read_compressed(&(minors[minor_idx]), session, msg,
+					 bufp, len);
+	}
+	copied = __copy_message(session, msg, bufp, len);
+	if (copied < 0) {
+		minor_unlock(&(minors[minor_idx]));
+		return copied;
+	}
+	__record_latency(&(minors[minor_idx]), msg);
+	if (msg->zc != NULL) {
+		msg->zc->status = 0;
+	}
+	if (minors[minor_idx].mode & MINOR_MODE_RETAIN) {
+		/* The message is kept, only the read offset moves forward */
+		*__read_offset(session) = msg->offset + 1;
+		minor_unlock(&(minors[minor_idx]));
+		return copied;
+	}
+	__unlink_message(&(minors[minor_idx]), msg);
+	minor_unlock(&(minors[minor_idx]));
+	__free_message(msg);
+	return copied;
+ remove_pending_read:
+	/* The pending read may have been already dequeued by a waker */
+	minor_lock(&(minors[minor_idx]));
+	if (!plist_node_empty(&(pending_read->list))) {
+		plist_del(&(pending_read->list),
+			  &(minors[minor_idx].pending_reads));
+	}
+	minor_unlock(&(minors[minor_idx]));
+	kfree(pending_read);
+	return ret;
+}
+
+/**
+* __add_expiry - Link a message with a time to live to the expiry list
+*
+* @minor: pointer to %minor_struct representing the device file
+* @msg: pointer to the just posted %message_struct
+*
+* NOTE The expiry list is kept sorted by expiration time. Messages mostly
+* expire in the same order they are posted, so the list is scanned backwards
+*/
+static void __add_expiry(struct minor_struct *minor, struct message_struct *msg)
+{
+	struct message_struct *prev;
+
+	msg->expires = jiffies + msg->ttl;
+	list_for_each_entry_reverse(prev, &(minor->expiry), expiry) {
+		if (!time_after(prev->expires, msg->expires)) {
+			list_add(&(msg->expiry), &(prev->expiry));
+			queue_delayed_work(system_wq, &(minor->sweep_work),
+					   TTL_SWEEP_INTERVAL);
+			return;
+		}
+	}
+	/* Earliest expiration: anticipate the sweep if needed */
+	list_add(&(msg->expiry), &(minor->expiry));
+	mod_delayed_work(system_wq, &(minor->sweep_work),
+			 max_t(unsigned long, msg->ttl, TTL_SWEEP_INTERVAL));
+}
+
+/**
+* __find_key - Retrieve the stored message with a given key
+*
+* @minor: pointer to %minor_struct representing the device file
+* @key: key of the message
+*
+* Returns the message or NULL if no message with @key is stored
+*
+* NOTE Messages are indexed by key in conflating mode only
+*/
+static struct message_struct *__find_key(struct minor_struct *minor,
+					 unsigned long long key)
+{
+	struct message_struct *msg;
+
+	hash_for_each_possible(minor->keys, msg, key_node, key) {
+		if (msg->key == key) {
+			return msg;
+		}
+	}
+	return NULL;
+}
+
+/**
+* __conflate - Replace the content of a stored message with a newer one
+*
+* @minor: pointer to %minor_struct representing the device file
+* @stale: pointer to the stored %message_struct with the same key of @msg
+* @msg: pointer to the %message_struct being posted
+*
+* Returns the number of written bytes. @msg is deallocated and @stale, that
+* keeps its position in the device file, carries the new content
+*
+* NOTE The new content must fit the device file in place of the old one.
+* @stale keeps its tag. The pinned pages of the old content, if any, are
+* released with @msg at the offset of @stale
+*/
+static int __conflate(struct minor_struct *minor,
+		      struct message_struct *stale, struct message_struct *msg)
+{
+	int ret;
+
+	minor->conflated++;
+	minor->current_size = minor->current_size - stale->size + msg->size;
+	minor->tag_bytes[stale->tag] = minor->tag_bytes[stale->tag] -
+	    stale->size + msg->size;
+	if (minor->mode & MINOR_MODE_PARTITION) {
+		minor->partition_bytes[stale->partition] =
+		    minor->partition_bytes[stale->partition] - stale->size +
+		    msg->size;
+	}
+	swap(stale->buf, msg->buf);
+	swap(stale->size, msg->size);
+	swap(stale->raw_size, msg->raw_size);
+	swap(stale->zc, msg->zc);
+	stale->posted = ktime_get();
+	stale->scheduled = msg->scheduled;
+	if (stale->ttl) {
+		list_del(&(stale->expiry));
+	}
+	stale->ttl = msg->ttl;
+	if (stale->ttl) {
+		__add_expiry(minor, stale);
+	}
+	if (stale->raw_size != stale->size) {
+		minor->compressed++;
+		minor->compress_saved += stale->raw_size - stale->size;
+	}
+	ret = stale->raw_size;
+	/* The old zerocopy pages, now in @msg, complete at the stale offset */
+	msg->offset = stale->offset;
+	__free_message(msg);
+	return ret;
+}
+
+/**
+* __route_reply - Hand a reply to the CALL waiting for it
+*
+* @minor: pointer to %minor_struct representing the reply device file
+* @msg: pointer to the reply %message_struct
+*
+* Returns the size of the reply. If no CALL is waiting for it (e.g. the
+* caller timed out), the reply is discarded and the post is reported as
+* succeeded anyway
+*/
+static int __route_reply(struct minor_struct *minor,
+			 struct message_struct *msg)
+{
+	int ret = msg->raw_size;
+	struct pending_read_struct *pending_call;
+
+	hash_for_each_possible(minor->calls, pending_call, call_node,
+			       msg->corr_id) {
+		if (pending_call->corr_id == msg->corr_id) {
+			hash_del(&(pending_call->call_node));
+			msg->posted = ktime_get();
+			WRITE_ONCE(pending_call->reply, msg);
+			wake_up_interruptible(&(minor->read_wq));
+			return ret;
+		}
+	}
+	minor->orphan_replies++;
+	__free_message(msg);
+	return ret;
+}
+
+/**
+* __post_message - Actually write a message into a device file
+* 
+* @minor: pointer to %minor_struct representing the target device file
+* @msg: pointer to the %message_struct to be posted. %size, %buf and %ttl
+*       must be already set
+* @offset: set to the offset of the stored message (in conflating mode, of
+*          the message whose content is replaced), or to %COMPLETION_NO_OFFSET
+*          if @msg is not stored. May be NULL
+*
+* Returns the number of written bytes on success. Otherwise, it returns
+* %-ENOSPC if the device file has no free space or %-ENOMEM if it fails in
+* indexing the message. On failure @msg is deallocated
+*
+* NOTE When the device file is full, the outcome depends on its overflow
+* policy: the post fails (%OVERFLOW_REJECT), the oldest messages are
+* discarded to make room for the new one (%OVERFLOW_DROP_OLDEST, always
+* applied in retained mode) or the new message is silently discarded
+* (%OVERFLOW_DROP_NEW). In the last case the post is reported as succeeded,
+* and the offset of the discarded message is not given to any other message
+* NOTE In conflating mode a keyed message replaces the content of the stored
+* message with the same key, if any
+* NOTE A reply is handed to the waiting %CALL rather than stored
+* */
+static int __post_message(struct minor_struct *minor,
+			  struct message_struct *msg,
+			  unsigned long long *offset)
+{
+	int ret;
+	unsigned int policy;
+	unsigned long long unused;
+	struct message_struct *oldest;
+	struct message_struct *stale = NULL;
+
+	if (offset == NULL) {
+		offset = &unused;
+	}
+	*offset = COMPLETION_NO_OFFSET;
+	if (msg->reply) {
+		return __route_reply(minor, msg);
+	}
+	if ((minor->mode & MINOR_MODE_CONFLATE) && msg->keyed) {
+		stale = __find_key(minor, msg->key);
+		if (stale && minor->current_size - stale->size + msg->size
+		    <= max_storage_size) {
+			*offset = stale->offset;
+			return __conflate(minor, stale, msg);
+		}
+	}
+
+	policy = minor->overflow_policy;
+	if (minor->mode & MINOR_MODE_RETAIN) {
+		policy = OVERFLOW_DROP_OLDEST;
+	}
+	/*
+	 * A stale message is only touched once the new one is sure to be
+	 * stored, otherwise the policy keeps the old content of its key
+	 */
+	if (minor->current_size + msg->size > max_storage_size) {
+		ret = msg->raw_size;
+		if (policy == OVERFLOW_DROP_NEW) {
+			/* The offset is consumed, leaving a gap for readers */
+			minor->dropped_new++;
+			WRITE_ONCE(minor->next_offset, minor->next_offset + 1);
+			__free_message(msg);
+			return ret;
+		}
+		if (policy == OVERFLOW_REJECT || msg->size > max_storage_size) {
+			__free_message(msg);
+			return -ENOSPC;
+		}
+		/* The new content is appended, as if the stale one expired */
+		if (stale) {
+			__unlink_message(minor, stale);
+			__free_message(stale);
+			minor->conflated++;
+		}
+		while (minor->current_size + msg->size > max_storage_size) {
+			oldest = list_first_entry(&(minor->fifo),
+						  struct message_struct, list);
+			__unlink_message(minor, oldest);
+			__free_message(oldest);
+			minor->dropped_oldest++;
+		}
+	}
+	msg->offset = minor->next_offset;
+	msg->posted = ktime_get();
+	if (minor->mode & MINOR_MODE_RETAIN) {
+		ret = xa_err(xa_store(&(minor->log), msg->offset, msg,
+				      GFP_KERNEL));
+		if (ret) {
+			__free_message(msg);
+			return ret;
+		}
+		ret = xa_err(xa_store(&(minor->tag_log[msg->tag]), msg->offset,
+				      msg, GFP_KERNEL));
+		if (ret) {
+			xa_erase(&(minor->log), msg->offset);
+			__free_message(msg);
+			return ret;
+		}
+		msg->tag_seq = minor->tag_posted[msg->tag]++;
+	}
+	INIT_LIST_HEAD(&(msg->list));
+	INIT_LIST_HEAD(&(msg->partition_list));
+	list_add_tail(&(msg->list), &(minor->fifo));
+	list_add_tail(&(msg->tag_list), &(minor->tags[msg->tag]));
+	minor->tag_count[msg->tag]++;
+	minor->tag_bytes[msg->tag] += msg->size;
+	if (minor->mode & MINOR_MODE_PARTITION) {
+		msg->partition = hash_64(msg->key, PARTITION_BITS);
+		list_add_tail(&(msg->partition_list),
+			      &(minor->partitions[msg->partition]));
+		minor->partition_count[msg->partition]++;
+		minor->partition_bytes[msg->partition] += msg->size;
+	}
+	if ((minor->mode & MINOR_MODE_CONFLATE) && msg->keyed) {
+		hash_add(minor->keys, &(msg->key_node), msg->key);
+	}
+	if (msg->ttl) {
+		__add_expiry(minor, msg);
+	}
+	minor->current_size += msg->size;
+	if (msg->raw_size != msg->size) {
+		minor->compressed++;
+		minor->compress_saved += msg->raw_size - msg->size;
+	}
+	WRITE_ONCE(minor->msg_count, minor->msg_count + 1);
+	WRITE_ONCE(minor->next_offset, minor->next_offset + 1);
+	*offset = msg->offset;
+
+	return msg->raw_size;
+}
+
+/**
+* __sweep_expired - Remove the expired messages from a device file
+*
+* @work_struct: pointer to the %struct work_struct embedded in %sweep_work
+*
+* NOTE Messages are removed in batches of %TTL_SWEEP_BATCH, releasing the
+* mutex of the device file in between. The sweep is scheduled again as long
+* as messages with a time to live are stored, at most once per
+* %TTL_SWEEP_INTERVAL
+*/
+static void __sweep_expired(struct work_struct *work_struct)
+{
+	unsigned int batch;
+	unsigned long delay;
+	struct minor_struct *minor;
+	struct message_struct *msg;
+
+	minor = container_of(to_delayed_work(work_struct), struct minor_struct,
+			     sweep_work);
+	minor_lock(minor);
+	while (1) {
+		for (batch = 0; batch < TTL_SWEEP_BATCH; batch++) {
+			msg = list_first_entry_or_null(&(minor->expiry),
+						       struct message_struct,
+						       expiry);
+			if (msg == NULL || !__message_expired(msg)) {
+				break;
+			}
+			__unlink_message(minor, msg);
+			__free_message(msg);
+			minor->expired_by_sweep++;
+		}
+		if (batch < TTL_SWEEP_BATCH) {
+			break;
+		}
+		/* Let readers and writers in between batches */
+		minor_unlock(minor);
+		cond_resched();
+		minor_lock(minor);
+	}
+	msg = list_first_entry_or_null(&(minor->expiry), struct message_struct,
+				       expiry);
+	if (msg) {
+		/* The head may expire right after the check above */
+		delay = time_after(msg->expires, jiffies) ?
+		    msg->expires - jiffies : 0;
+		queue_delayed_work(system_wq, &(minor->sweep_work),
+				   max_t(unsigned long, delay,
+					 TTL_SWEEP_INTERVAL));
+	}
+	minor_unlock(minor);
+}
+
+/**
+* __awake_pending_readers - Awakes the readers waiting for new messages
+* 
+* @minor: pointer to %minor_struct representing the device file
+* @nr: number of messages just posted
+*
+* The first @nr pending readers (in priority order) whose low watermark is
+* reached are woken. The max-latency timer of the readers that are skipped is
+* started, so that they are woken anyway within their max latency. The same
+* is done for the sessions polling the device file.
+*
+* NOTE In retained mode every reader is woken, since each of them reads the
+* new messages along its own offset
+*/
+static void __awake_pending_readers(struct minor_struct *minor,
+				    unsigned int nr)
+{
+	unsigned int awaken = 0;
+	struct pending_read_struct *pending_read;
+	struct pending_read_struct *tmp;
+	struct session_struct *session;
+
+	plist_for_each_entry_safe(pending_read, tmp, &(minor->pending_reads),
+				  list) {
+		if (!__queued_messages(minor, pending_read->session)) {
+			continue;	/* nothing passes its tag filter */
+		}
+		if (!__lowat_reached(minor, pending_read->session)) {
+			__arm_lowat_timer(pending_read->session);
+			continue;
+		}
+		plist_del(&(pending_read->list), &(minor->pending_reads));
+		pending_read->msg_available = 1;
+		awaken++;
+		if (!(minor->mode & MINOR_MODE_RETAIN) && awaken == nr) {
+			break;
+		}
+	}
+	if (awaken) {
+		wake_up_interruptible(&(minor->read_wq));
+	}
+
+	/*
+	 * dev_poll() joins poll_wq before taking the mutex of the device file,
+	 * so only the sessions being polled right now have waiters
+	 */
+	list_for_each_entry(session, &(minor->sessions), list) {
+		if (!waitqueue_active(&(session->poll_wq))
+		    || !__queued_messages(minor, session)) {
+			continue;
+		}
+		if (__lowat_reached(minor, session)) {
+			wake_up_interruptible(&(session->poll_wq));
+		} else {
+			__arm_lowat_timer(session);
+		}
+	}
+	return;
+}
+
+/**
+* __awake_pending_reader - Awakes a reader waiting for messages
+* 
+* @minor: pointer to %minor_struct representing the device file
+*
+*/
+static void __awake_pending_reader(struct minor_struct *minor)
+{
+	__awake_pending_readers(minor, 1);
+}
+
+/**
+* __messages_posted - Awake readers and notify sessions of new messages
+*
+* @minor: pointer to %minor_struct representing the device file
+* @nr: number of messages just stored, not 0
+*
+* Besides the blocked readers and the pollers, the eventfd of every session
+* is signaled with @nr and SIGIO is sent to the owners of the sessions with
+* O_ASYNC set
+*
+* NOTE Called once per batch of posts with the mutex of the device file
+* held, so that a burst is a single notification. Sessions are notified
+* regardless of their tag filters and partitions. Posts that store nothing
+* (%OVERFLOW_DROP_NEW drops, routed replies) notify nobody
+*/
+static void __messages_posted(struct minor_struct *minor, unsigned int nr)
+{
+	struct session_struct *session;
+
+	__awake_pending_readers(minor, nr);
+	if (minor->eventfds) {
+		list_for_each_entry(session, &(minor->sessions), list) {
+			if (session->eventfd != NULL) {
+				eventfd_add(session->eventfd, nr);
+			}
+		}
+	}
+	kill_fasync(&(minor->fasync), SIGIO, POLL_IN);
+}
+
+/**
+* __deferred_write - Write a message in a device file after a delay
+* 
+* @work_struct: pointer to %struct work_struct
+*
+* NOTE the %struct work_struct is embedded inside a %struct delayed_work.
+* This is embedded too inside a %struct pending_write_struct
+*
+* NOTE The outcome is queued to the writer session as a %COMPLETION_POST
+* completion, if requested. The message may be freed by the post, so only
+* the offset the device file assigns to new messages is reported
+* NOTE Writes restored from a snapshot have no session and are listed in the
+* device file, protected by its mutex
+*/
+static void __deferred_write(struct work_struct *work_struct)
+{
+	int ret;
+	unsigned long long offset;
+	struct delayed_work *delayed_work;
+	struct pending_write_struct *pending_write;
+	struct session_struct *session;
+	struct minor_struct *minor;
+
+	delayed_work = container_of(work_struct, struct delayed_work, work);
+	pending_write = container_of(delayed_work, struct pending_write_struct,
+				     delayed_work);
+	session = pending_write->session;
+	/* Dequeue from the list of pending writes */
+	if (session != NULL) {
+		session_lock(session);
+		list_del(&(pending_write->list));
+		session_unlock(session);
+	}
+
+	minor = &(minors[pending_write->minor]);
+	minor_lock(minor);
+	/* Restored writes are listed in the device file instead */
+	if (session == NULL) {
+		list_del(&(pending_write->list));
+	}
+	ret = __post_message(minor, pending_write->msg, &offset);
+	if (offset != COMPLETION_NO_OFFSET) {	/* message stored */
+		__messages_posted(minor, 1);
+	}
+	minor_unlock(minor);
+
+	if (session != NULL && READ_ONCE(session->post_completions)) {
+		spin_lock(&completion_lock);
+		__push_completion(session, COMPLETION_POST,
+				  ret < 0 ? ret : 0, pending_write->seq, offset);
+		spin_unlock(&completion_lock);
+	}
+	kfree(pending_write);
+	return;
+}
+
+/**
+* __deferred_write_cpu - Choose the CPU executing a deferred write
+*
+* @minor: pointer to %minor_struct representing the target device file
+* @session: pointer to %session_struct representing the I/O session
+*
+* Returns a CPU according to the write affinity of the session, or
+* %WORK_CPU_UNBOUND if no CPU is preferred
+*
+* NOTE With %WRITE_AFFINITY_NODE the CPU of the writer is used if it belongs
+* to the node, so that deferred writes are spread over the node
+*/
+static int __deferred_write_cpu(struct minor_struct *minor,
+				struct session_struct *session)
+{
+	int cpu, node;
+
+	cpu = raw_smp_processor_id();
+	switch (session->write_affinity) {
+	case WRITE_AFFINITY_WRITER:
+		return cpu;
+	case WRITE_AFFINITY_CPU:
+		if (cpu_online(session->write_affinity_target)) {
+			return session->write_affinity_target;
+		}
+		break;
+	case WRITE_AFFINITY_NODE:
+		node = session->write_affinity_target;
+		if (node == NUMA_NO_NODE) {
+			node = READ_ONCE(minor->node);
+		}
+		if (node == NUMA_NO_NODE || cpu_to_node(cpu) == node) {
+			return cpu;
+		}
+		cpu = cpumask_any_and(cpumask_of_node(node), cpu_online_mask);
+		if (cpu < nr_cpu_ids) {
+			return cpu;
+		}
+		break;
+	}
+	return WORK_CPU_UNBOUND;
+}
+
+/**
+* __alloc_message - Allocate a message not yet linked to a device file
+*
+* @len: size of the payload
+* @node: NUMA node where the message is allocated
+*
+* Returns the message, with no payload attached, or NULL
+*/
+static struct message_struct *__alloc_message(size_t len, int node)
+{
+	struct message_struct *msg;
+
+	msg = kmalloc_node(sizeof(struct message_struct), GFP_KERNEL, node);
+	if (msg == NULL) {
+		return NULL;
+	}
+	msg->size = len;
+	msg->raw_size = len;
+	msg->buf = NULL;
+	msg->zc = NULL;
+	msg->offset = 0;
+	msg->ttl = 0;
+	msg->scheduled = 0;
+	msg->keyed = 0;
+	msg->key = 0;
+	INIT_HLIST_NODE(&(msg->key_node));
+	msg->tag = 0;
+	msg->reply = 0;
+	msg->corr_id = 0;
+	return msg;
+}
+
+/**
+* __pin_message - Reference the pages of a user buffer from a message
+*
+* @session: pointer to the %session_struct of the writer
+* @msg: pointer to the %message_struct to fill
+* @bufp: user buffer containing the payload
+* @node: NUMA node where the auxiliary structures are allocated
+*
+* Returns 0 on success, %-ENOMEM or %-EFAULT if the buffer cannot be pinned
+*/
+static int __pin_message(struct session_struct *session,
+			 struct message_struct *msg, const char __user *bufp,
+			 int node)
+{
+	int pinned;
+	unsigned long start;
+	struct zerocopy_struct *zc;
+
+	zc = kmalloc_node(sizeof(struct zerocopy_struct), GFP_KERNEL, node);
+	if (zc == NULL) {
+		return -ENOMEM;
+	}
+	start = (unsigned long)bufp;
+	zc->first_offset = offset_in_page(start);
+	zc->nr_pages = DIV_ROUND_UP(zc->first_offset + msg->size, PAGE_SIZE);
+	zc->pages = kvmalloc_array(zc->nr_pages, sizeof(struct page *),
+				   GFP_KERNEL);
+	if (zc->pages == NULL) {
+		kfree(zc);
+		return -ENOMEM;
+	}
+	/*
+	 * The pages are only read, FOLL_WRITE is not needed. They may stay
+	 * pinned for as long as the message is stored: FOLL_LONGTERM moves
+	 * them out of ZONE_MOVABLE and CMA first, and refuses fsdax mappings
+	 */
+	pinned = pin_user_pages_fast(start & PAGE_MASK, zc->nr_pages,
+				     FOLL_LONGTERM, zc->pages);
+	if (pinned != zc->nr_pages) {
+		while (pinned > 0) {
+			unpin_user_page(zc->pages[--pinned]);
+		}
+		kvfree(zc->pages);
+		kfree(zc);
+		return -EFAULT;
+	}
+	zc->cookie = start;
+	zc->status = -ECANCELED;
+	zc->session = session;
+	spin_lock(&completion_lock);
+	list_add_tail(&(zc->list), &(session->zerocopy_msgs));
+	spin_unlock(&completion_lock);
+	msg->zc = zc;
+	return 0;
+}
+
+/**
+* __compress_message - Compress the payload of a message, if worth it
+*
+* @session: pointer to the %session_struct the message is written along
+* @msg: pointer to the %message_struct to compress
+* @node: NUMA node where the compressed payload is allocated
+*
+* NOTE The payload is left as is if it does not shrink or memory is missing
+* NOTE Must be called with the mutex of @session held, since the LZ4 working
+* memory and the output buffer are allocated once per session
+*/
+static void __compress_message(struct session_struct *session,
+			       struct message_struct *msg, int node)
+{
+	int clen;
+	char *cbuf;
+
+	if (session->compress_wrkmem == NULL) {
+		session->compress_wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+		if (session->compress_wrkmem == NULL) {
+			return;
+		}
+	}
+	if (session->compress_buf_size < msg->size) {
+		kvfree(session->compress_buf);
+		session->compress_buf = kvmalloc(msg->size, GFP_KERNEL);
+		if (session->compress_buf == NULL) {
+			session->compress_buf_size = 0;
+			return;
+		}
+		session->compress_buf_size = msg->size;
+	}
+	/* Keep the compressed payload only if it is actually smaller */
+	clen = LZ4_compress_default(msg->buf, session->compress_buf, msg->size,
+				    msg->size - 1, session->compress_wrkmem);
+	if (clen <= 0) {
+		return;
+	}
+	cbuf = kmalloc_node(clen, GFP_KERNEL, node);
+	if (cbuf == NULL) {
+		return;
+	}
+	memcpy(cbuf, session->compress_buf, clen);
+	kfree(msg->buf);
+	msg->buf = cbuf;
+	msg->size = clen;
+}
+
+/**
+* __refill_tokens - Refill a token bucket lazily
+*
+* @tokens: tokens in the bucket, scaled by NSEC_PER_SEC (may be negative)
+* @rate: tokens per second
+* @burst: size of the bucket
+* @elapsed: nanoseconds since the last refill
+*
+* Returns the new number of tokens, scaled by NSEC_PER_SEC
+*/
+static s64 __refill_tokens(s64 tokens, unsigned int rate, unsigned int burst,
+			   s64 elapsed)
+{
+	s64 cap = (s64)burst * NSEC_PER_SEC;
+
+	if (elapsed >= div64_s64(cap - tokens, rate)) {
+		return cap;
+	}
+	return tokens + elapsed * rate;
+}
+
+/**
+* __tokens_cost - Tokens charged to a bucket for a write
+*
+* @cost: tokens needed, scaled by NSEC_PER_SEC
+* @burst: size of the bucket
+*
+* NOTE A write larger than the bucket only needs a full bucket
+*/
+static s64 __tokens_cost(s64 cost, unsigned int burst)
+{
+	return min_t(s64, cost, (s64)burst * NSEC_PER_SEC);
+}
+
+/**
+* __tokens_wait - Time until a bucket holds enough tokens for a write
+*
+* @tokens: tokens in the bucket, scaled by NSEC_PER_SEC
+* @cost: tokens charged, scaled by NSEC_PER_SEC (see __tokens_cost())
+* @rate: tokens per second
+*
+* Returns the nanoseconds to wait, 0 if the tokens are already there
+*/
+static s64 __tokens_wait(s64 tokens, s64 cost, unsigned int rate)
+{
+	if (tokens >= cost) {
+		return 0;
+	}
+	return div64_s64(cost - tokens + rate - 1, rate);
+}
+
+/**
+* __release_jiffy - Jiffy a message is released at, as requested through the
+* write header
+*
+* @header: pointer to the %write_header_struct of the message
+*
+* Returns the 64 bits jiffy, 0 if the message must be stored immediately
+*
+* NOTE A release time is mapped through the reference sampled on module
+* load rather than through the current jiffies, so that messages released
+* at the same time are due at the same jiffy, whoever writes them and when.
+* The jiffy is rounded up (one more covers the phase of the reference), the
+* message must not be posted before its release time
+*/
+static u64 __release_jiffy(struct write_header_struct *header)
+{
+	if (header->flags & WRITE_HEADER_RELEASE) {
+		if (header->release <= ktime_get_ns()) {
+			return 0;
+		}
+		return release_ref_jiffies +
+		    div64_u64(header->release - release_ref_ns + TICK_NSEC - 1,
+			      TICK_NSEC) + 1;
+	}
+	if (header->release == 0) {
+		return 0;
+	}
+	return get_jiffies_64() + nsecs_to_jiffies64(header->release) + 1;
+}
+
+/**
+* __jiffies_until - Delay until a jiffy
+*
+* @jiffy: 64 bits jiffy, as returned by __release_jiffy()
+*
+* Returns the delay in jiffies, 0 if @jiffy is already reached
+*/
+static unsigned long __jiffies_until(u64 jiffy)
+{
+	u64 now = get_jiffies_64();
+
+	if (!time_after64(jiffy, now)) {
+		return 0;
+	}
+	return min_t(u64, jiffy - now, MAX_JIFFY_OFFSET);
+}
+
+/**
+* __rate_limit - Charge a write to the token buckets of a session
+*
+* @session: pointer to the %session_struct of the writer
+* @len: size of the message
+* @delay: set to the jiffies the post must be delayed by
+*
+* Returns 0 if the write can go on, %-EAGAIN if it is rejected
+*
+* NOTE The buckets are refilled here, no timer is involved. With
+* %RATE_LIMIT_DELAY the tokens are borrowed from the future: the buckets go
+* negative and the following writes wait for the debt too. The debt is
+* capped at one burst, past it writes are rejected, so that delays (and the
+* pending writes) stay bounded
+* NOTE Must be called with the mutex of @session held
+*/
+static int __rate_limit(struct session_struct *session, size_t len,
+			unsigned long *delay)
+{
+	s64 wait = 0;
+	s64 msg_cost = 0;
+	s64 byte_cost = 0;
+	ktime_t now;
+	s64 elapsed;
+	struct rate_limit_struct *rate_limit = &(session->rate_limit);
+
+	now = ktime_get();
+	elapsed = ktime_to_ns(ktime_sub(now, session->rate_refill));
+	session->rate_refill = now;
+	if (rate_limit->msgs_per_sec) {
+		session->msg_tokens =
+		    __refill_tokens(session->msg_tokens,
+				    rate_limit->msgs_per_sec,
+				    rate_limit->burst_msgs, elapsed);
+		msg_cost = __tokens_cost(NSEC_PER_SEC, rate_limit->burst_msgs);
+		wait = __tokens_wait(session->msg_tokens, msg_cost,
+				     rate_limit->msgs_per_sec);
+	}
+	if (rate_limit->bytes_per_sec) {
+		session->byte_tokens =
+		    __refill_tokens(session->byte_tokens,
+				    rate_limit->bytes_per_sec,
+				    rate_limit->burst_bytes, elapsed);
+		byte_cost = __tokens_cost((s64)len * NSEC_PER_SEC,
+					  rate_limit->burst_bytes);
+		wait = max(wait, __tokens_wait(session->byte_tokens, byte_cost,
+					       rate_limit->bytes_per_sec));
+	}
+	if (wait && rate_limit->action == RATE_LIMIT_REJECT) {
+		return -EAGAIN;
+	}
+	if (session->msg_tokens - msg_cost <
+	    -(s64)rate_limit->burst_msgs * NSEC_PER_SEC
+	    || session->byte_tokens - byte_cost <
+	    -(s64)rate_limit->burst_bytes * NSEC_PER_SEC) {
+		return -EAGAIN;
+	}
+	session->msg_tokens -= msg_cost;
+	session->byte_tokens -= byte_cost;
+	*delay = wait ? nsecs_to_jiffies(wait + TICK_NSEC - 1) : 0;
+	return 0;
+}
+
+/**
+* __refund_tokens - Give back the tokens charged to a write that failed
+*
+* @session: pointer to the %session_struct of the writer
+* @len: size of the message
+*
+* NOTE Must be called with the mutex of @session held
+*/
+static void __refund_tokens(struct session_struct *session, size_t len)
+{
+	s64 cap;
+	struct rate_limit_struct *rate_limit = &(session->rate_limit);
+
+	if (rate_limit->msgs_per_sec) {
+		cap = (s64)rate_limit->burst_msgs * NSEC_PER_SEC;
+		session->msg_tokens = min(cap, session->msg_tokens +
+					  __tokens_cost(NSEC_PER_SEC,
+							rate_limit->burst_msgs));
+	}
+	if (rate_limit->bytes_per_sec) {
+		cap = (s64)rate_limit->burst_bytes * NSEC_PER_SEC;
+		session->byte_tokens = min(cap, session->byte_tokens +
+					   __tokens_cost((s64)len * NSEC_PER_SEC,
+							 rate_limit->burst_bytes));
+	}
+}
+
+/**
+* __set_rate_limit - Configure the token buckets of a session
+*
+* @session: pointer to %session_struct representing the I/O session
+* @rate_limit: pointer to the requested %rate_limit_struct
+*
+* Returns 0 on success or %-EINVAL if the action is not valid
+*
+* NOTE Must be called with the mutex of @session held
+*/
+static int __set_rate_limit(struct session_struct *session,
+			    struct rate_limit_struct *rate_limit)
+{
+	if (rate_limit->action != RATE_LIMIT_REJECT
+	    && rate_limit->action != RATE_LIMIT_DELAY) {
+		return -EINVAL;
+	}
+	if (!rate_limit->burst_msgs) {
+		rate_limit->burst_msgs = rate_limit->msgs_per_sec;
+	}
+	if (!rate_limit->burst_bytes) {
+		rate_limit->burst_bytes = rate_limit->bytes_per_sec;
+	}
+	session->rate_limit = *rate_limit;
+	session->msg_tokens = (s64)rate_limit->burst_msgs * NSEC_PER_SEC;
+	session->byte_tokens = (s64)rate_limit->burst_bytes * NSEC_PER_SEC;
+	session->rate_refill = ktime_get();
+	WRITE_ONCE(session->rate_limited, rate_limit->msgs_per_sec
+		   || rate_limit->bytes_per_sec);
+	return 0;
+}
+
+/**
+* __publish_corked - Publish the batch staged by a corked session
+*
+* @session: pointer to %session_struct representing the I/O session
+*
+* Returns the number of stored messages, or %-ENOSPC if the batch does not
+* fit the device file and its overflow policy is %OVERFLOW_REJECT. In that
+* case no message of the batch is posted, and the batch is counted by
+* %rejected_batches
+*
+* NOTE Must be called with the cork mutex of @session held. The batch is
+* posted with a single hold of the mutex of the device file, then readers
+* are awaken in a single pass, so that they see the whole batch or nothing.
+* Messages discarded by the overflow policy or routed as replies are not
+* counted
+*/
+static int __publish_corked(struct session_struct *session)
+{
+	int ret = 0;
+	unsigned int bytes;
+	unsigned long long offset;
+	struct minor_struct *minor;
+	struct message_struct *msg;
+	struct message_struct *tmp;
+	LIST_HEAD(batch);
+
+	if (list_empty(&(session->cork_msgs))) {
+		return 0;
+	}
+	list_splice_init(&(session->cork_msgs), &batch);
+	bytes = session->cork_bytes;
+	session->cork_count = 0;
+	session->cork_bytes = 0;
+	cancel_delayed_work(&(session->cork_work));
+
+	minor = &(minors[session->minor]);
+	minor_lock(minor);
+	if (minor->overflow_policy == OVERFLOW_REJECT
+	    && !(minor->mode & MINOR_MODE_RETAIN)
+	    && minor->current_size + bytes > max_storage_size) {
+		minor->rejected_batches++;
+		ret = -ENOSPC;
+	}
+	list_for_each_entry_safe(msg, tmp, &batch, list) {
+		list_del(&(msg->list));
+		if (ret < 0) {
+			__free_message(msg);
+		} else if (__post_message(minor, msg, &offset) >= 0
+			   && offset != COMPLETION_NO_OFFSET) {
+			ret++;
+		}
+	}
+	if (ret > 0) {
+		__messages_posted(minor, ret);
+	}
+	minor_unlock(minor);
+	return ret;
+}
+
+/**
+* __cork_message - Stage a message written along a corked session
+*
+* @session: pointer to %session_struct representing the I/O session
+* @msg: pointer to the %message_struct to stage
+*
+* Returns 1 if the session is not corked (@msg is untouched), 0 if @msg is
+* staged, or the error of the batch published because @msg hit a bound
+*
+* NOTE A message that would take the staged batch past max_bytes starts the
+* next batch, after the staged one is published: batches never exceed
+* max_bytes, so they fit an empty device file. If that publication fails,
+* @msg is freed and not staged
+*/
+static int __cork_message(struct session_struct *session,
+			  struct message_struct *msg)
+{
+	int ret;
+	unsigned int max_bytes;
+
+	mutex_lock(&(session->cork_mtx));
+	if (!session->corked) {
+		mutex_unlock(&(session->cork_mtx));
+		return 1;
+	}
+	max_bytes = session->cork.max_bytes ? session->cork.max_bytes :
+	    READ_ONCE(max_storage_size);
+	if (session->cork_count
+	    && session->cork_bytes + msg->size > max_bytes) {
+		ret = __publish_corked(session);
+		if (ret < 0) {
+			mutex_unlock(&(session->cork_mtx));
+			__free_message(msg);
+			return ret;
+		}
+	}
+	list_add_tail(&(msg->list), &(session->cork_msgs));
+	session->cork_count++;
+	session->cork_bytes += msg->size;
+
+	if ((session->cork.max_msgs
+	     && session->cork_count >= session->cork.max_msgs)
+	    || session->cork_bytes >= max_bytes) {
+		ret = __publish_corked(session);
+		mutex_unlock(&(session->cork_mtx));
+		return ret < 0 ? ret : 0;
+	}
+	if (session->cork_count == 1 && session->cork.max_latency) {
+		schedule_delayed_work(&(session->cork_work),
+				      msecs_to_jiffies(session->cork.max_latency));
+	}
+	mutex_unlock(&(session->cork_mtx));
+	return 0;
+}
+
+/**
+* __cork_timeout - Publish a staged batch whose latency bound is hit
+*
+* @work_struct: pointer to the %struct work_struct embedded in the
+*               %cork_work of a session
+*
+* NOTE No write waits for this publication, so a discarded batch is queued
+* to the session as a %COMPLETION_BATCH completion
+*/
+static void __cork_timeout(struct work_struct *work_struct)
+{
+	int ret;
+	unsigned int count;
+	struct session_struct *session;
+
+	session = container_of(to_delayed_work(work_struct),
+			       struct session_struct, cork_work);
+	mutex_lock(&(session->cork_mtx));
+	count = session->cork_count;
+	ret = __publish_corked(session);
+	mutex_unlock(&(session->cork_mtx));
+	if (ret < 0) {
+		spin_lock(&completion_lock);
+		__push_completion(session, COMPLETION_BATCH, ret, count,
+				  COMPLETION_NO_OFFSET);
+		spin_unlock(&completion_lock);
+	}
+}
+
+/**
+* __uncork - Stop staging the writes of a session
+*
+* @session: pointer to %session_struct representing the I/O session
+*
+* Returns the number of stored messages of the staged batch, or the error of
+* its publication
+*/
+static int __uncork(struct session_struct *session)
+{
+	int ret;
+
+	mutex_lock(&(session->cork_mtx));
+	WRITE_ONCE(session->corked, 0);
+	ret = __publish_corked(session);
+	mutex_unlock(&(session->cork_mtx));
+	return ret;
+}
+
+static ssize_t dev_write(struct file *filep, const char *bufp, size_t len,
+			 loff_t * offp)
+{
+	char *kbuf = NULL;
+	int minor_idx, ret, node, cpu, zerocopy;
+	int charged = 0;
+	size_t header_len = 0;
+	unsigned long long offset;
+	unsigned long write_timeout, rate_delay = 0;
+	int header_release = 0;
+	u64 release_jiffy = 0;
+	struct write_header_struct header;
+	struct message_struct *msg;
+	struct pending_write_struct *pending_write;
+	struct session_struct *session;
+
+	session = (struct session_struct *)filep->private_data;
+
+	/* Retrieve the write header, if the session requested it */
+	memset(&header, 0, sizeof(struct write_header_struct));
+	if (READ_ONCE(session->write_header)) {
+		header_len = sizeof(struct write_header_struct);
+		if (len < header_len) {
+			return -EINVAL;
+		}
+		if (copy_from_user(&header, bufp, header_len)) {
+			return -EFAULT;
+		}
+		if (header.flags & ~WRITE_HEADER_MASK) {
+			return -EINVAL;
+		}
+		if ((header.flags & WRITE_HEADER_TAG) && header.tag >= MSG_TAGS) {
+			return -EINVAL;
+		}
+		if ((header.flags & WRITE_HEADER_DELAY)
+		    && (header.flags & WRITE_HEADER_RELEASE)) {
+			return -EINVAL;
+		}
+		if (header.flags & (WRITE_HEADER_DELAY | WRITE_HEADER_RELEASE)) {
+			header_release = 1;
+			release_jiffy = __release_jiffy(&header);
+		}
+		bufp += header_len;
+		len -= header_len;
+	}
+
+	if (len > max_message_size) {
+		return -EMSGSIZE;
+	}
+
+	/* Charge the token buckets before allocating anything */
+	if (READ_ONCE(session->rate_limited)) {
+		session_lock(session);
+		ret = __rate_limit(session, len, &rate_delay);
+		session_unlock(session);
+		if (ret) {
+			return ret;
+		}
+		charged = 1;
+	}
+
+	minor_idx = fminor(filep);
+	/* Messages are allocated on the NUMA node of the device file */
+	node = READ_ONCE(minors[minor_idx].node);
+
+	/* With zerocopy, the pages of the user buffer are pinned instead */
+	zerocopy = READ_ONCE(session->zerocopy) && len;
+	if (!zerocopy) {
+		/* Allocate a kernel buffer */
+		kbuf = kmalloc_node(len, GFP_KERNEL, node);
+		if (kbuf == NULL) {
+			ret = -ENOMEM;
+			goto refund;
+		}
+
+		/* Copy the message in the kernel buffer */
+		if (copy_from_user(kbuf, bufp, len)) {
+			kfree(kbuf);
+			ret = -EFAULT;
+			goto refund;
+		}
+	}
+
+	/* Allocate the message_struct out of the critical sections */
+	msg = __alloc_message(len, node);
+	if (msg == NULL) {
+		kfree(kbuf);
+		ret = -ENOMEM;
+		goto refund;
+	}
+	msg->buf = kbuf;
+	msg->keyed = !!(header.flags & WRITE_HEADER_KEY);
+	msg->key = header.key;
+	msg->tag = (header.flags & WRITE_HEADER_TAG) ? header.tag : 0;
+	msg->reply = !!(header.flags & WRITE_HEADER_REPLY);
+	msg->corr_id = msg->reply ? header.corr_id : 0;
+	if (zerocopy) {
+		ret = __pin_message(session, msg, bufp, node);
+		if (ret) {
+			__free_message(msg);
+			goto refund;
+		}
+	}
+
+	session_lock(session);
+	if ((READ_ONCE(minors[minor_idx].mode) & MINOR_MODE_COMPRESS)
+	    && len > READ_ONCE(compress_threshold) && msg->zc == NULL) {
+		__compress_message(session, msg, node);
+	}
+	msg->ttl = session->msg_ttl;
+	write_timeout = header_release ? __jiffies_until(release_jiffy) :
+	    session->write_timeout;
+	write_timeout += rate_delay;
+	if (write_timeout) {	/* a write timeout exists */
+		msg->scheduled = ktime_get();
+		/* Allocate a pending_write_struct */
+		pending_write = kmalloc_node(sizeof(struct pending_write_struct),
+					     GFP_KERNEL, node);
+		if (pending_write == NULL) {
+			__free_message(msg);
+			if (charged) {
+				__refund_tokens(session, len);
+			}
+			session_unlock(session);
+			return -ENOMEM;
+		}
+		/* Initialize the pending_write_struct */
+		pending_write->minor = minor_idx;
+		pending_write->session = session;
+		pending_write->msg = msg;
+		pending_write->seq = session->deferred_seq++;
+		INIT_LIST_HEAD(&(pending_write->list));
+		INIT_DELAYED_WORK(&(pending_write->delayed_work),
+				  __deferred_write);
+		/* Enqueue the pending write to the list of the others */
+		list_add_tail(&(pending_write->list),
+			      &(session->pending_writes));
+		cpu = __deferred_write_cpu(&(minors[minor_idx]), session);
+		session_unlock(session);
+		/* The release jiffy may have come closer in the meantime */
+		if (header_release) {
+			write_timeout = __jiffies_until(release_jiffy) + rate_delay;
+		}
+		queue_delayed_work_on(cpu, session->write_wq,
+				      &(pending_write->delayed_work),
+				      write_timeout);
+		return 0;	/* no byte actually written */
+	}
+
+	session_unlock(session);
+
+	/* A corked session stages the message instead */
+	if (READ_ONCE(session->corked)) {
+		ret = __cork_message(session, msg);
+		if (ret <= 0) {
+			return ret ? ret : len + header_len;
+		}
+	}
+
+	/* Immediate storing */
+	minor_lock(&(minors[minor_idx]));
+	ret = __post_message(&minors[minor_idx], msg, &offset);
+	if (ret >= 0) {		/* message post succeeded */
+		ret += header_len;
+	}
+	if (offset != COMPLETION_NO_OFFSET) {	/* message stored */
+		__messages_posted(&(minors[minor_idx]), 1);
+	}
+	minor_unlock(&(minors[minor_idx]));
+	if (ret >= 0) {
+		return ret;
+	}
+
+refund:
+	/* A failed write does not consume the budget of the session */
+	if (charged) {
+		session_lock(session);
+		__refund_tokens(session, len);
+		session_unlock(session);
+	}
+	return ret;
+}
+
+/**
+* __revoke_delayed_messages - Cancel delayed write of an I/O session
+*
+* @session: pointer to %struct session_struct representing the I/O session
+*
+*/
+static void __revoke_delayed_messages(struct session_struct *session)
+{
+	struct list_head *ptr;
+	struct list_head *tmp;
+	struct pending_write_struct *pending_write;
+
+	list_for_each_safe(ptr, tmp, &(session->pending_writes)) {
+		pending_write = list_entry(ptr, struct pending_write_struct,
+					   list);
+
+		/* NOTE that the pending write may be actually already in execution
+		   thus we have to check return value */
+		if (cancel_delayed_work(&(pending_write->delayed_work))) {
+			list_del(&(pending_write->list));
+			__free_message(pending_write->msg);
+			if (session->post_completions) {
+				spin_lock(&completion_lock);
+				__push_completion(session, COMPLETION_POST,
+						  -ECANCELED,
+						  pending_write->seq,
+						  COMPLETION_NO_OFFSET);
+				spin_unlock(&completion_lock);
+			}
+			kfree(pending_write);
+		}
+	}
+}
+
+/**
+* __pop_completion - Dequeue the oldest completion of a session
+*
+* @session: pointer to the %session_struct
+* @completion: pointer to the %completion_struct to fill
+*
+* Returns 0 on success, %-ENOMSG if the queue is empty or %-EOVERFLOW if it
+* is empty but completions were lost since the previous call
+*/
+static int __pop_completion(struct session_struct *session,
+			    struct completion_struct *completion)
+{
+	int ret = 0;
+
+	spin_lock(&completion_lock);
+	if (session->completion_count == 0) {
+		ret = session->completions_lost ? -EOVERFLOW : -ENOMSG;
+		session->completions_lost = 0;
+		spin_unlock(&completion_lock);
+		return ret;
+	}
+	*completion = session->completions[session->completion_head];
+	session->completion_head =
+	    (session->completion_head + 1) % COMPLETION_RING;
+	session->completion_count--;
+	spin_unlock(&completion_lock);
+	return ret;
+}
+
+/**
+* __set_minor_mode - Change the operating mode of a device file
+*
+* @minor: pointer to %minor_struct representing the device file
+* @mode: new %MINOR_MODE_* flags
+*
+* Returns 0 on success, %-EINVAL if @mode is not valid or %-EBUSY if the
+* retained or the conflating mode is requested while messages are stored
+*
+* NOTE Leaving the retained or the conflating mode keeps the stored
+* messages, that are then delivered in FIFO order
+*/
+static int __set_minor_mode(struct minor_struct *minor, unsigned long mode)
+{
+	int bkt;
+	unsigned int tag, partition;
+	struct hlist_node *tmp;
+	struct message_struct *msg;
+	struct message_struct *next;
+
+	if (mode & ~MINOR_MODE_MASK) {
+		return -EINVAL;
+	}
+	if ((mode & MINOR_MODE_RETAIN)
+	    && (mode & (MINOR_MODE_CONFLATE | MINOR_MODE_PARTITION))) {
+		return -EINVAL;
+	}
+	/* Stored messages are neither indexed by offset, key nor partition */
+	if ((mode & ~minor->mode & (MINOR_MODE_RETAIN | MINOR_MODE_CONFLATE |
+				    MINOR_MODE_PARTITION))
+	    && !list_empty(&(minor->fifo))) {
+		return -EBUSY;
+	}
+	if (!(mode & MINOR_MODE_RETAIN) && (minor->mode & MINOR_MODE_RETAIN)) {
+		xa_destroy(&(minor->log));
+		for (tag = 0; tag < MSG_TAGS; tag++) {
+			xa_destroy(&(minor->tag_log[tag]));
+		}
+	}
+	if (!(mode & MINOR_MODE_CONFLATE)
+	    && (minor->mode & MINOR_MODE_CONFLATE)) {
+		hash_for_each_safe(minor->keys, bkt, tmp, msg, key_node) {
+			hash_del(&(msg->key_node));
+		}
+	}
+	if (!(mode & MINOR_MODE_PARTITION)
+	    && (minor->mode & MINOR_MODE_PARTITION)) {
+		for (partition = 0; partition < PARTITIONS; partition++) {
+			list_for_each_entry_safe(msg, next,
+						 &(minor->partitions[partition]),
+						 partition_list) {
+				list_del(&(msg->partition_list));
+			}
+			minor->partition_count[partition] = 0;
+			minor->partition_bytes[partition] = 0;
+		}
+	}
+	WRITE_ONCE(minor->mode, mode);
+	return 0;
+}
+
+/**
+* __rebalance_partitions - Spread the partitions among the consumers
+*
+* @minor: pointer to %minor_struct representing the device file
+*
+* Each consumer owns PARTITIONS / nr_consumers partitions, one more for the
+* first PARTITIONS % nr_consumers consumers. The assignment is sticky: a
+* consumer keeps its partitions up to its quota, and only the partitions
+* in excess or without owner move to the consumers below their quota.
+*
+* NOTE Blocked readers are awaken, since they may own new messages
+*/
+static void __rebalance_partitions(struct minor_struct *minor)
+{
+	unsigned int i, quota, extra, partition;
+	struct session_struct *session;
+	struct session_struct *owner;
+
+	list_for_each_entry(session, &(minor->consumers), consumer_list) {
+		session->partitions = 0;
+		session->nr_partitions = 0;
+	}
+	if (minor->nr_consumers == 0) {
+		memset(minor->partition_owner, 0,
+		       sizeof(minor->partition_owner));
+		return;
+	}
+	quota = PARTITIONS / minor->nr_consumers;
+	extra = PARTITIONS % minor->nr_consumers;
+
+	/* Keep the partitions within quota, release the others */
+	i = 0;
+	list_for_each_entry(session, &(minor->consumers), consumer_list) {
+		for (partition = 0; partition < PARTITIONS; partition++) {
+			if (minor->partition_owner[partition] != session) {
+				continue;
+			}
+			if (session->nr_partitions < quota + (i < extra)) {
+				session->partitions |= 1U << partition;
+				session->nr_partitions++;
+			} else {
+				minor->partition_owner[partition] = NULL;
+			}
+		}
+		i++;
+	}
+
+	/* Give the released partitions to the consumers below quota */
+	i = 0;
+	owner = list_first_entry(&(minor->consumers), struct session_struct,
+				 consumer_list);
+	for (partition = 0; partition < PARTITIONS; partition++) {
+		if (minor->partition_owner[partition] != NULL) {
+			continue;
+		}
+		while (owner->nr_partitions >= quota + (i < extra)) {
+			owner = list_next_entry(owner, consumer_list);
+			i++;
+		}
+		minor->partition_owner[partition] = owner;
+		owner->partitions |= 1U << partition;
+		owner->nr_partitions++;
+	}
+	__awake_pending_reader(minor);
+}
+
+/**
+* __set_consumer - Add an I/O session to the consumers or remove it
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+* @consumer: non-zero to add the session
+*
+*/
+static void __set_consumer(struct minor_struct *minor,
+			   struct session_struct *session, int consumer)
+{
+	unsigned int partition;
+
+	if (!!consumer == session->consumer) {
+		return;
+	}
+	if (consumer) {
+		list_add_tail(&(session->consumer_list), &(minor->consumers));
+		minor->nr_consumers++;
+	} else {
+		for (partition = 0; partition < PARTITIONS; partition++) {
+			if (minor->partition_owner[partition] == session) {
+				minor->partition_owner[partition] = NULL;
+			}
+		}
+		list_del_init(&(session->consumer_list));
+		minor->nr_consumers--;
+		session->partitions = 0;
+		session->nr_partitions = 0;
+	}
+	WRITE_ONCE(session->consumer, !!consumer);
+	__rebalance_partitions(minor);
+}
+
+/**
+* __leave_group - Detach an I/O session from its consumer group
+*
+* @session: pointer to %session_struct representing the I/O session
+*
+* NOTE The session keeps reading from the offset reached by the group. The
+* group survives with no members, so that its offset can be resumed later,
+* until it is deleted through %DELETE_GROUP
+*/
+static void __leave_group(struct session_struct *session)
+{
+	if (session->group == NULL) {
+		return;
+	}
+	session->offset = session->group->offset;
+	session->group->members--;
+	session->group = NULL;
+}
+
+/**
+* __find_group - Look up a consumer group of a device file by name
+*
+* @minor: pointer to %minor_struct representing the device file
+* @name: name of the group
+* @groups: set to the number of groups of the device file, if not found
+*
+* Returns the group, or NULL if it does not exist
+*/
+static struct group_struct *__find_group(struct minor_struct *minor,
+					 const char *name, unsigned int *groups)
+{
+	struct group_struct *group;
+
+	*groups = 0;
+	list_for_each_entry(group, &(minor->groups), list) {
+		if (strcmp(group->name, name) == 0) {
+			return group;
+		}
+		(*groups)++;
+	}
+	return NULL;
+}
+
+/**
+* __add_group - Look up a consumer group of a device file, creating it if
+* needed
+*
+* @minor: pointer to %minor_struct representing the device file
+* @name: name of the group
+* @offset: offset a new group starts reading from
+*
+* Returns the group, or ERR_PTR(%-ENOSPC) if the maximum number of groups is
+* reached, or ERR_PTR(%-ENOMEM) if it fails in allocating a %group_struct
+*/
+static struct group_struct *__add_group(struct minor_struct *minor,
+					const char *name, unsigned long offset)
+{
+	struct group_struct *group;
+	unsigned int groups;
+
+	group = __find_group(minor, name, &groups);
+	if (group) {
+		return group;
+	}
+	if (groups >= MAX_GROUPS) {
+		return ERR_PTR(-ENOSPC);
+	}
+	group = kmalloc(sizeof(struct group_struct), GFP_KERNEL);
+	if (group == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+	strscpy(group->name, name, GROUP_NAME_LEN);
+	group->offset = offset;
+	group->members = 0;
+	list_add_tail(&(group->list), &(minor->groups));
+	return group;
+}
+
+/**
+* __join_group - Attach an I/O session to a consumer group
+*
+* @minor: pointer to %minor_struct representing the device file
+* @session: pointer to %session_struct representing the I/O session
+* @name: name of the group
+*
+* Returns 0 on success, %-ENOSPC if the maximum number of groups is reached
+* or %-ENOMEM if it fails in allocating a new %group_struct
+*
+* NOTE A new group starts reading from the oldest retained message
+*/
+static int __join_group(struct minor_struct *minor,
+			struct session_struct *session, const char *name)
+{
+	struct group_struct *group;
+
+	group = __add_group(minor, name, __head_offset(minor));
+	if (IS_ERR(group)) {
+		return PTR_ERR(group);
+	}
+	__leave_group(session);
+	group->members++;
+	session->group = group;
+	return 0;
+}
+
+/**
+* __delete_group - Free a consumer group of a device file
+*
+* @minor: pointer to %minor_struct representing the device file
+* @name: name of the group
+*
+* Returns 0 on success, %-ENOENT if the group does not exist or %-EBUSY if
+* sessions are still joined to it
+*
+* NOTE The offset of the group is lost: a group joined again with the same
+* name starts from the oldest retained message
+*/
+static int __delete_group(struct minor_struct *minor, const char *name)
+{
+	struct group_struct *group;
+	unsigned int groups;
+
+	group = __find_group(minor, name, &groups);
+	if (group == NULL) {
+		return -ENOENT;
+	}
+	if (group->members) {
+		return -EBUSY;
+	}
+	list_del(&(group->list));
+	kfree(group);
+	return 0;
+}
+
+/**
+* __group_name - Copy the name of a consumer group from user space
+*
+* @name: buffer of %GROUP_NAME_LEN bytes receiving the name
+* @argp: user address of the string
+*
+* Returns 0 on success, %-EINVAL if the name is empty, %-ENAMETOOLONG if it
+* does not fit %GROUP_NAME_LEN or %-EFAULT
+*/
+static long __group_name(char *name, const char __user *argp)
+{
+	long name_len;
+
+	name_len = strncpy_from_user(name, argp, GROUP_NAME_LEN);
+	if (name_len < 0) {
+		return name_len;
+	}
+	if (name_len == 0) {
+		return -EINVAL;
+	}
+	if (name_len == GROUP_NAME_LEN) {
+		return -ENAMETOOLONG;
+	}
+	return 0;
+}
+
+/**
+* __node_valid - Check if a NUMA node can be used for allocations
+*
+* @node: NUMA node identifier
+*
+*/
+static int __node_valid(int node)
+{
+	return node >= 0 && node < nr_node_ids && node_online(node);
+}
+
+/**
+* __check_write_affinity - Validate a write affinity provided by the user
+*
+* @write_affinity: pointer to the %write_affinity_struct to validate
+*
+* Returns 0 if valid, %-EINVAL otherwise
+*/
+static int __check_write_affinity(struct write_affinity_struct *write_affinity)
+{
+	int target = write_affinity->target;
+
+	switch (write_affinity->policy) {
+	case WRITE_AFFINITY_NONE:
+	case WRITE_AFFINITY_WRITER:
+		return 0;
+	case WRITE_AFFINITY_CPU:
+		if (target < 0 || target >= nr_cpu_ids || !cpu_online(target)) {
+			return -EINVAL;
+		}
+		return 0;
+	case WRITE_AFFINITY_NODE:
+		if (target != NUMA_NO_NODE && !__node_valid(target)) {
+			return -EINVAL;
+		}
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/**
+* __call - Post a request and wait for the reply with the same correlation ID
+*
+* @filep: pointer to %struct file of the session posting the request
+* @argp: user pointer to the %call_struct
+*
+* Returns the number of bytes of the reply copied to the user buffer, or an
+* error as described for dev_ioctl()
+*
+* NOTE The pending call is registered before the request is posted, so that
+* a reply cannot arrive before someone waits for it
+*/
+static long __call(struct file *filep, struct call_struct __user *argp)
+{
+	long ret;
+	int flushing, node;
+	char *kbuf;
+	unsigned long long corr_id, offset;
+	unsigned long timeout;
+	struct call_struct call;
+	struct message_struct *msg;
+	struct minor_struct *minor;
+	struct minor_struct *reply_minor;
+	struct session_struct *session;
+	struct pending_read_struct *pending_call;
+
+	session = (struct session_struct *)filep->private_data;
+	if (copy_from_user(&call, argp, sizeof(struct call_struct))) {
+		return -EFAULT;
+	}
+	if (call.reply_minor >= MINORS || !call.timeout) {
+		return -EINVAL;
+	}
+	if (call.request_len > max_message_size) {
+		return -EMSGSIZE;
+	}
+	minor = &(minors[fminor(filep)]);
+	reply_minor = &(minors[call.reply_minor]);
+	corr_id = atomic64_inc_return(&next_corr_id);
+	if (put_user(corr_id, &(argp->corr_id))) {
+		return -EFAULT;
+	}
+
+	/* Build the request */
+	node = READ_ONCE(minor->node);
+	kbuf = kmalloc_node(call.request_len, GFP_KERNEL, node);
+	if (kbuf == NULL) {
+		return -ENOMEM;
+	}
+	if (copy_from_user(kbuf, u64_to_user_ptr(call.request),
+			   call.request_len)) {
+		kfree(kbuf);
+		return -EFAULT;
+	}
+	msg = __alloc_message(call.request_len, node);
+	if (msg == NULL) {
+		kfree(kbuf);
+		return -ENOMEM;
+	}
+	msg->buf = kbuf;
+	msg->corr_id = corr_id;
+	session_lock(session);
+	msg->ttl = session->msg_ttl;
+	session_unlock(session);
+
+	/* Register the pending call on the reply minor */
+	pending_call = kmalloc(sizeof(struct pending_read_struct), GFP_KERNEL);
+	if (pending_call == NULL) {
+		__free_message(msg);
+		return -ENOMEM;
+	}
+	pending_call->msg_available = 0;
+	pending_call->flushing = 0;
+	pending_call->session = session;
+	plist_node_init(&(pending_call->list), 0);
+	pending_call->corr_id = corr_id;
+	pending_call->reply = NULL;
+	minor_lock(reply_minor);
+	hash_add(reply_minor->calls, &(pending_call->call_node), corr_id);
+	minor_unlock(reply_minor);
+
+	/* Post the request, calls are never delayed */
+	minor_lock(minor);
+	ret = __post_message(minor, msg, &offset);
+	if (offset != COMPLETION_NO_OFFSET) {
+		__messages_posted(minor, 1);
+	}
+	minor_unlock(minor);
+	if (ret < 0) {
+		goto unregister_call;
+	}
+
+	timeout = max_t(unsigned long, ((unsigned long)call.timeout * HZ) / 1000,
+			1);
+	ret = wait_event_interruptible_timeout(reply_minor->read_wq,
+					       READ_ONCE(pending_call->reply)
+					       || READ_ONCE(pending_call->
+							    flushing), timeout);
+	if (ret == 0) {
+		ret = -ETIME;
+	}
+
+ unregister_call:
+	/* The reply may have arrived in the meantime */
+	minor_lock(reply_minor);
+	if (!hlist_unhashed(&(pending_call->call_node))) {
+		hash_del(&(pending_call->call_node));
+	}
+	msg = pending_call->reply;
+	flushing = pending_call->flushing;
+	minor_unlock(reply_minor);
+	kfree(pending_call);
+
+	if (msg != NULL) {
+		ret = __copy_message(session, msg, u64_to_user_ptr(call.reply),
+				     call.reply_len);
+		if (ret >= 0 && msg->zc != NULL) {
+			msg->zc->status = 0;
+		}
+		__free_message(msg);
+		return ret;
+	}
+	if (flushing) {
+		return -ECANCELED;
+	}
+	return ret < 0 ? ret : -ETIME;
+}
+
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	long ret = 0;
+	int minor_idx;
+	unsigned long offset;
+	char name[GROUP_NAME_LEN];
+	struct rcvlowat_struct rcvlowat;
+	struct write_affinity_struct write_affinity;
+	struct completion_struct completion;
+	struct rate_limit_struct rate_limit;
+	struct cork_struct cork;
+	struct peek_struct peek;
+	struct eventfd_ctx *eventfd;
+	unsigned long long tag_filter;
+	struct minor_struct *minor;
+	struct session_struct *session;
+
+	session = (struct session_struct *)filep->private_data;
+	minor_idx = fminor(filep);
+	minor = &(minors[minor_idx]);
+
+	switch (cmd) {
+	case SET_SEND_TIMEOUT:
+		session_lock(session);
+		session->write_timeout = (arg * HZ) / 1000;
+		session_unlock(session);
+		break;
+	case SET_RECV_TIMEOUT:
+		session_lock(session);
+		WRITE_ONCE(session->read_timeout, (arg * HZ) / 1000);
+		session_unlock(session);
+		break;
+	case REVOKE_DELAYED_MESSAGES:
+		session_lock(session);
+		__revoke_delayed_messages(session);
+		session_unlock(session);
+		break;
+	case SET_MSG_TTL:
+		session_lock(session);
+		session->msg_ttl = (arg * HZ) / 1000;
+		session_unlock(session);
+		break;
+	case SET_WRITE_HEADER:
+		session_lock(session);
+		WRITE_ONCE(session->write_header, !!arg);
+		session_unlock(session);
+		break;
+	case SET_ZEROCOPY:
+		session_lock(session);
+		WRITE_ONCE(session->zerocopy, !!arg);
+		session_unlock(session);
+		break;
+	case GET_COMPLETION:
+		ret = __pop_completion(session, &completion);
+		if (!ret && copy_to_user((void __user *)arg, &completion,
+					 sizeof(struct completion_struct))) {
+			ret = -EFAULT;
+		}
+		break;
+	case SET_TAG_FILTER:
+		if (copy_from_user(&tag_filter, (void __user *)arg,
+				   sizeof(unsigned long long))) {
+			return -EFAULT;
+		}
+		if (!tag_filter) {
+			return -EINVAL;
+		}
+		minor_lock(minor);
+		session->tag_filter = tag_filter;
+		/* Stored messages may now pass the filter of blocked readers */
+		__awake_pending_reader(minor);
+		minor_unlock(minor);
+		break;
+	case CALL:
+		return __call(filep, (struct call_struct __user *)arg);
+	case SET_OVERFLOW_POLICY:
+		if (arg > OVERFLOW_DROP_NEW) {
+			return -EINVAL;
+		}
+		minor_lock(minor);
+		minor->overflow_policy = arg;
+		minor_unlock(minor);
+		break;
+	case SET_READ_HEADER:
+		session_lock(session);
+		WRITE_ONCE(session->read_header, !!arg);
+		session_unlock(session);
+		break;
+	case SET_BUSY_POLL_US:
+		if (arg > BUSY_POLL_MAX_US) {
+			return -EINVAL;
+		}
+		session_lock(session);
+		WRITE_ONCE(session->busy_poll_us, arg);
+		WRITE_ONCE(session->busy_poll_budget, arg);
+		session_unlock(session);
+		break;
+	case SET_WRITE_AFFINITY:
+		if (copy_from_user(&write_affinity, (void __user *)arg,
+				   sizeof(struct write_affinity_struct))) {
+			return -EFAULT;
+		}
+		ret = __check_write_affinity(&write_affinity);
+		if (ret) {
+			return ret;
+		}
+		session_lock(session);
+		session->write_affinity = write_affinity.policy;
+		session->write_affinity_target = write_affinity.target;
+		session_unlock(session);
+		break;
+	case SET_READ_PRIORITY:
+		if ((int)arg != READ_PRIO_TASK
+		    && ((int)arg < 0 || (int)arg >= READ_PRIO_LEVELS)) {
+			return -EINVAL;
+		}
+		session_lock(session);
+		WRITE_ONCE(session->read_prio, (int)arg);
+		session_unlock(session);
+		break;
+	case SET_POST_COMPLETIONS:
+		session_lock(session);
+		WRITE_ONCE(session->post_completions, !!arg);
+		session_unlock(session);
+		break;
+	case CORK:
+		if (copy_from_user(&cork, (void __user *)arg,
+				   sizeof(struct cork_struct))) {
+			return -EFAULT;
+		}
+		/* A batch of max_bytes must fit an empty device file */
+		if (cork.max_bytes > READ_ONCE(max_storage_size)) {
+			return -EINVAL;
+		}
+		mutex_lock(&(session->cork_mtx));
+		session->cork = cork;
+		WRITE_ONCE(session->corked, 1);
+		mutex_unlock(&(session->cork_mtx));
+		break;
+	case UNCORK:
+		return __uncork(session);
+	case PEEK_SIZE:
+		return __peek_message(minor, session, NULL, 0, NULL);
+	case PEEK:
+		if (copy_from_user(&peek, (void __user *)arg,
+				   sizeof(struct peek_struct))) {
+			return -EFAULT;
+		}
+		ret = __peek_message(minor, session, u64_to_user_ptr(peek.buf),
+				     peek.len, &(peek.size));
+		if (ret >= 0
+		    && put_user(peek.size,
+				&(((struct peek_struct __user *)arg)->size))) {
+			return -EFAULT;
+		}
+		break;
+	case SET_STRICT_READ:
+		session_lock(session);
+		WRITE_ONCE(session->strict_read, !!arg);
+		session_unlock(session);
+		break;
+	case REGISTER_EVENTFD:
+		eventfd = NULL;
+		if ((int)arg >= 0) {
+			eventfd = eventfd_ctx_fdget((int)arg);
+			if (IS_ERR(eventfd)) {
+				return PTR_ERR(eventfd);
+			}
+		}
+		/* Read by posts, under the mutex of the device file */
+		minor_lock(minor);
+		swap(session->eventfd, eventfd);
+		minor->eventfds += !!session->eventfd - !!eventfd;
+		minor_unlock(minor);
+		if (eventfd != NULL) {
+			eventfd_ctx_put(eventfd);
+		}
+		break;
+	case REGISTER_COMPLETION_EVENTFD:
+		eventfd = NULL;
+		if ((int)arg >= 0) {
+			eventfd = eventfd_ctx_fdget((int)arg);
+			if (IS_ERR(eventfd)) {
+				return PTR_ERR(eventfd);
+			}
+		}
+		/* Completions come from outside the mutex of the device file */
+		spin_lock(&completion_lock);
+		swap(session->completion_eventfd, eventfd);
+		spin_unlock(&completion_lock);
+		if (eventfd != NULL) {
+			eventfd_ctx_put(eventfd);
+		}
+		break;
+	case SET_RATE_LIMIT:
+		if (copy_from_user(&rate_limit, (void __user *)arg,
+				   sizeof(struct rate_limit_struct))) {
+			return -EFAULT;
+		}
+		session_lock(session);
+		ret = __set_rate_limit(session, &rate_limit);
+		session_unlock(session);
+		break;
+	case SET_MINOR_NODE:
+		/* -1 may come as an int, without sign extension */
+		if (arg == (unsigned int)NUMA_NO_NODE) {
+			arg = (unsigned long)NUMA_NO_NODE;
+		}
+		if (arg != (unsigned long)NUMA_NO_NODE
+		    && (arg > INT_MAX || !__node_valid((int)arg))) {
+			return -EINVAL;
+		}
+		minor_lock(minor);
+		WRITE_ONCE(minor->node, (int)arg);
+		minor_unlock(minor);
+		break;
+	case SET_RCVLOWAT:
+		if (copy_from_user(&rcvlowat, (void __user *)arg,
+				   sizeof(struct rcvlowat_struct))) {
+			return -EFAULT;
+		}
+		/* Retained messages stay stored: bytes cannot be waited for */
+		if (rcvlowat.bytes
+		    && (READ_ONCE(minor->mode) & MINOR_MODE_RETAIN)) {
+			return -EINVAL;
+		}
+		/* Read locklessly by writers, see __lowat_reached() */
+		session_lock(session);
+		WRITE_ONCE(session->lowat_msgs, max(rcvlowat.msgs, 1U));
+		WRITE_ONCE(session->lowat_bytes, rcvlowat.bytes);
+		WRITE_ONCE(session->lowat_latency,
+			   ((unsigned long)rcvlowat.max_latency * HZ) / 1000);
+		session_unlock(session);
+		break;
+	case SET_MINOR_MODE:
+		minor_lock(minor);
+		ret = __set_minor_mode(minor, arg);
+		minor_unlock(minor);
+		break;
+	case SEEK_OFFSET:
+		minor_lock(minor);
+		if (!(minor->mode & MINOR_MODE_RETAIN)) {
+			ret = -EINVAL;
+		} else {
+			offset = max(arg, __head_offset(minor));
+			*__read_offset(session) = min(offset,
+						      minor->next_offset);
+		}
+		minor_unlock(minor);
+		break;
+	case GET_OFFSET:
+		minor_lock(minor);
+		if (!(minor->mode & MINOR_MODE_RETAIN)) {
+			ret = -EINVAL;
+		}
+		offset = max(*__read_offset(session), __head_offset(minor));
+		minor_unlock(minor);
+		if (!ret && put_user((unsigned long long)offset,
+				     (unsigned long long __user *)arg)) {
+			ret = -EFAULT;
+		}
+		break;
+	case JOIN_GROUP:
+		ret = __group_name(name, (const char __user *)arg);
+		if (ret < 0) {
+			return ret;
+		}
+		minor_lock(minor);
+		ret = __join_group(minor, session, name);
+		minor_unlock(minor);
+		break;
+	case DELETE_GROUP:
+		ret = __group_name(name, (const char __user *)arg);
+		if (ret < 0) {
+			return ret;
+		}
+		minor_lock(minor);
+		ret = __delete_group(minor, name);
+		minor_unlock(minor);
+		break;
+	case SET_CONSUMER:
+		minor_lock(minor);
+		__set_consumer(minor, session, arg);
+		minor_unlock(minor);
+		break;
+	case LEAVE_GROUP:
+		minor_lock(minor);
+		__leave_group(session);
+		minor_unlock(minor);
+		break;
+	default:
+		printk(KERN_INFO "%s: ioctl() command not valid\n", MODNAME);
+		return -ENOTTY;
+	}
+	return ret;
+}
+
+static __poll_t dev_poll(struct file *filep, poll_table *wait)
+{
+	int minor_idx;
+	__poll_t mask;
+	struct session_struct *session;
+
+	session = (struct session_struct *)filep->private_data;
+	minor_idx = fminor(filep);
+
+	poll_wait(filep, &(session->poll_wq), wait);
+
+	/* Writes never block */
+	mask = EPOLLOUT | EPOLLWRNORM;
+	minor_lock(&(minors[minor_idx]));
+	if (__next_message(&(minors[minor_idx]), session)) {
+		if (__lowat_reached(&(minors[minor_idx]), session)
+		    || READ_ONCE(session->lowat_expired)) {
+			mask |= EPOLLIN | EPOLLRDNORM;
+		} else {
+			__arm_lowat_timer(session);
+		}
+	}
+	minor_unlock(&(minors[minor_idx]));
+	if (READ_ONCE(session->completion_count)) {
+		mask |= EPOLLPRI;
+	}
+	return mask;
+}
+
+static int dev_fasync(int fd, struct file *filep, int on)
+{
+	return fasync_helper(fd, filep, on, &(minors[fminor(filep)].fasync));
+}
+
+/**
+* __unblock_reads - Unblock readers waiting for messages
+*
+* @minor: pointer to %struct minor_struct representing the target device file
+*
+*/
+static void __unblock_reads(struct minor_struct *minor)
+{
+	int bkt;
+	struct hlist_node *node;
+	struct pending_read_struct *pending_read;
+	struct pending_read_struct *tmp;
+
+	plist_for_each_entry_safe(pending_read, tmp, &(minor->pending_reads),
+				  list) {
+		pending_read->flushing = 1;
+		plist_del(&(pending_read->list), &(minor->pending_reads));
+		wake_up_interruptible(&(minor->read_wq));
+	}
+	/* So are the calls waiting for a reply */
+	hash_for_each_safe(minor->calls, bkt, node, pending_read, call_node) {
+		WRITE_ONCE(pending_read->flushing, 1);
+		hash_del(&(pending_read->call_node));
+		wake_up_interruptible(&(minor->read_wq));
+	}
+}
+
+static int dev_flush(struct file *filep, fl_owner_t id)
+{
+	int minor_idx;
+	struct list_head *ptr;
+	struct session_struct *session;
+
+	minor_idx = fminor(filep);
+	minor_lock(&(minors[minor_idx]));
+	/* Revoke delayed writes */
+	list_for_each(ptr, &(minors[minor_idx].sessions)) {
+		session = list_entry(ptr, struct session_struct, list);
+		session_lock(session);
+		__revoke_delayed_messages(session);
+		session_unlock(session);
+	}
+	/* Readers waiting for messages are unblocked */
+	__unblock_reads(&(minors[minor_idx]));
+	minor_unlock(&(minors[minor_idx]));
+
+	return 0;
+}
+
+static int dev_release(struct inode *inodep, struct file *filep)
+{
+	struct session_struct *session_struct;
+	struct zerocopy_struct *zc;
+	struct zerocopy_struct *tmp;
+	int minor_idx;
+
+	session_struct = (struct session_struct *)filep->private_data;
+	/* Wait for delayed write in execution to complete */
+	flush_workqueue(session_struct->write_wq);
+	destroy_workqueue(session_struct->write_wq);
+	/*
+	 * The staged batch, if any, is published as on UNCORK. Nobody can get
+	 * its error any more, a discarded batch is only counted
+	 */
+	cancel_delayed_work_sync(&(session_struct->cork_work));
+	__uncork(session_struct);
+	/* Unlink session_struct from minor_struct */
+	minor_idx = iminor(inodep);
+	minor_lock(&(minors[minor_idx]));
+	__leave_group(session_struct);
+	__set_consumer(&(minors[minor_idx]), session_struct, 0);
+	list_del(&(session_struct->list));
+	minors[minor_idx].eventfds -= !!session_struct->eventfd;
+	minor_unlock(&(minors[minor_idx]));
+	/* Nobody can arm the max-latency timer anymore */
+	timer_delete_sync(&(session_struct->lowat_timer));
+	/* Messages referencing pinned pages survive their writer */
+	spin_lock(&completion_lock);
+	list_for_each_entry_safe(zc, tmp, &(session_struct->zerocopy_msgs),
+				 list) {
+		zc->session = NULL;
+		list_del(&(zc->list));
+	}
+	spin_unlock(&completion_lock);
+	if (session_struct->eventfd != NULL) {
+		eventfd_ctx_put(session_struct->eventfd);
+	}
+	if (session_struct->completion_eventfd != NULL) {
+		eventfd_ctx_put(session_struct->completion_eventfd);
+	}
+	vfree(session_struct->compress_wrkmem);
+	kvfree(session_struct->compress_buf);
+
+	kfree(session_struct);
+
+	return 0;
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct minor_struct *minor = m->private;
+
+	minor_lock(minor);
+	seq_printf(m, "current_size %u\n", minor->current_size);
+	seq_printf(m, "msg_count %u\n", minor->msg_count);
+	seq_printf(m, "expired_on_read %lu\n", minor->expired_on_read);
+	seq_printf(m, "expired_by_sweep %lu\n", minor->expired_by_sweep);
+	seq_printf(m, "dropped_oldest %lu\n", minor->dropped_oldest);
+	seq_printf(m, "dropped_new %lu\n", minor->dropped_new);
+	seq_printf(m, "rejected_batches %lu\n", minor->rejected_batches);
+	seq_printf(m, "conflated %lu\n", minor->conflated);
+	seq_printf(m, "orphan_replies %lu\n", minor->orphan_replies);
+	seq_printf(m, "compressed %lu\n", minor->compressed);
+	seq_printf(m, "compress_saved %lu\n", minor->compress_saved);
+	seq_printf(m, "busy_poll_hits %ld\n",
+		   atomic_long_read(&(minor->busy_poll_hits)));
+	seq_printf(m, "busy_poll_misses %ld\n",
+		   atomic_long_read(&(minor->busy_poll_misses)));
+	minor_unlock(minor);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static int latency_show(struct seq_file *m, void *v)
+{
+	int i;
+	struct minor_struct *minor = m->private;
+
+	minor_lock(minor);
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		if (minor->latency_hist[i]) {
+			seq_printf(m, "%llu %lu\n", 1ULL << i,
+				   minor->latency_hist[i]);
+		}
+	}
+	minor_unlock(minor);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+#ifdef TIMED_MSG_LOCK_STATS
+static int locks_show(struct seq_file *m, void *v)
+{
+	int i, nr;
+	struct minor_struct *minor = m->private;
+	struct lock_site *site;
+	struct lock_stat *stat;
+
+	spin_lock(&lock_sites_lock);
+	nr = lock_sites_nr;
+	spin_unlock(&lock_sites_lock);
+	seq_puts(m, "lock site acquired contended wait_ns max_wait_ns hold_ns "
+		 "max_hold_ns\n");
+	for (i = 0; i < LOCK_SITES; i++) {
+		if (i >= nr && i != LOCK_SITES - 1) {
+			continue;
+		}
+		stat = &(minor->lock_stats[i]);
+		if (!atomic64_read(&(stat->acquired))) {
+			continue;
+		}
+		site = i < nr ? lock_sites[i] : NULL;
+		seq_printf(m, "%s %s:%u %lld %lld %lld %lld %lld %lld\n",
+			   site ? site->lock : "any",
+			   site ? site->func : "other", site ? site->line : 0,
+			   (long long)atomic64_read(&(stat->acquired)),
+			   (long long)atomic64_read(&(stat->contended)),
+			   (long long)atomic64_read(&(stat->wait_ns)),
+			   (long long)atomic64_read(&(stat->max_wait_ns)),
+			   (long long)atomic64_read(&(stat->hold_ns)),
+			   (long long)atomic64_read(&(stat->max_hold_ns)));
+	}
+	return 0;
+}
+
+static int locks_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, locks_show, inode->i_private);
+}
+
+/**
+* locks_write - Reset the lock statistics of a device file
+*
+* NOTE Whatever is written, the counters are zeroed. Concurrent acquisitions
+* may survive the reset partially
+*/
+static ssize_t locks_write(struct file *file, const char __user *bufp,
+			   size_t len, loff_t *offp)
+{
+	int i;
+	struct minor_struct *minor =
+	    ((struct seq_file *)file->private_data)->private;
+	struct lock_stat *stat;
+
+	for (i = 0; i < LOCK_SITES; i++) {
+		stat = &(minor->lock_stats[i]);
+		atomic64_set(&(stat->acquired), 0);
+		atomic64_set(&(stat->contended), 0);
+		atomic64_set(&(stat->wait_ns), 0);
+		atomic64_set(&(stat->max_wait_ns), 0);
+		atomic64_set(&(stat->hold_ns), 0);
+		atomic64_set(&(stat->max_hold_ns), 0);
+	}
+	return len;
+}
+
+static const struct file_operations locks_fops = {
+	.owner = THIS_MODULE,
+	.open = locks_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.write = locks_write,
+	.release = single_release,
+};
+#endif
+
+/**
+* __snapshot_payload - Copy the stored payload of a message
+*
+* @msg: pointer to the %message_struct to copy
+* @dst: destination buffer, at least @msg->size bytes
+*
+*/
+static void __snapshot_payload(struct message_struct *msg, char *dst)
+{
+	unsigned int i, chunk, page_offset;
+	size_t copied = 0;
+	char *vaddr;
+	struct zerocopy_struct *zc = msg->zc;
+
+	if (zc == NULL) {
+		memcpy(dst, msg->buf, msg->size);
+		return;
+	}
+	page_offset = zc->first_offset;
+	for (i = 0; copied < msg->size; i++) {
+		chunk = min_t(size_t, PAGE_SIZE - page_offset,
+			      msg->size - copied);
+		vaddr = kmap(zc->pages[i]);
+		memcpy(dst + copied, vaddr + page_offset, chunk);
+		kunmap(zc->pages[i]);
+		copied += chunk;
+		page_offset = 0;
+	}
+}
+
+/**
+* __snapshot_record - Append a message to a snapshot
+*
+* @dst: where the record is written, NULL to only account its size
+* @msg: pointer to the %message_struct to append
+* @flags: %SNAPSHOT_DELAYED for a delayed post, 0 otherwise
+* @ttl: remaining time to live in jiffies, 0 means forever
+* @delay: remaining delay in jiffies
+*
+* Returns the size of the record, including the payload
+*/
+static size_t __snapshot_record(char *dst, struct message_struct *msg,
+				unsigned int flags, unsigned long ttl,
+				unsigned long delay)
+{
+	struct snapshot_record rec;
+
+	if (dst != NULL) {
+		memset(&rec, 0, sizeof(rec));
+		rec.flags = flags;
+		if (msg->keyed) {
+			rec.flags |= SNAPSHOT_KEYED;
+		}
+		if (msg->raw_size != msg->size) {
+			rec.flags |= SNAPSHOT_COMPRESSED;
+		}
+		rec.tag = msg->tag;
+		rec.size = msg->size;
+		rec.raw_size = msg->raw_size;
+		rec.offset = (flags & SNAPSHOT_DELAYED) ? 0 : msg->offset;
+		rec.key = msg->key;
+		rec.ttl = jiffies_to_nsecs(ttl);
+		rec.delay = jiffies_to_nsecs(delay);
+		memcpy(dst, &rec, sizeof(rec));
+		__snapshot_payload(msg, dst + sizeof(rec));
+	}
+	return sizeof(rec) + msg->size;
 }
 
 /**
-* __awake_pending_reader - Awakes a reader waiting for messages
-* 
-* @minor: pointer to %minor_struct representing the device file
+* __snapshot_pending - Append a list of delayed posts to a snapshot
+*
+* @dst: buffer of the snapshot, NULL to only account the size
+* @cap: capacity of @dst
+* @len: bytes of the snapshot already filled
+* @pending_writes: list of %pending_write_struct
+* @now: jiffies when the snapshot started
 *
+* Returns the new size of the snapshot
+*
+* NOTE Posts queued after the size of the snapshot was accounted may not fit
+* in @cap and are left out. So are replies, routed to live calls only
 */
-static void __awake_pending_reader(struct minor_struct *minor)
+static size_t __snapshot_pending(char *dst, size_t cap, size_t len,
+				 struct list_head *pending_writes,
+				 unsigned long now)
 {
-	struct pending_read_struct *pending_read;
+	unsigned long delay;
+	struct timer_list *timer;
+	struct message_struct *msg;
+	struct pending_write_struct *pending_write;
 
-	pending_read = list_first_entry_or_null(&(minor->pending_reads),
-						struct pending_read_struct,
-						list);
-	if (pending_read) {
-		list_del(&(pending_read->list));
-		pending_read->msg_available = 1;
-		wake_up_interruptible(&(minor->read_wq));
+	list_for_each_entry(pending_write, pending_writes, list) {
+		msg = pending_write->msg;
+		if (msg->reply
+		    || len + sizeof(struct snapshot_record) + msg->size > cap) {
+			continue;
+		}
+		timer = &(pending_write->delayed_work.timer);
+		delay = 0;
+		if (timer_pending(timer) && time_after(timer->expires, now)) {
+			delay = timer->expires - now;
+		}
+		len += __snapshot_record(dst ? dst + len : NULL, msg,
+					 SNAPSHOT_DELAYED, msg->ttl, delay);
 	}
-	return;
+	return len;
 }
 
 /**
-* __deferred_write - Write a message in a device file after a delay
-* 
-* @work_struct: pointer to %struct work_struct
+* __snapshot_minor - Serialize the content of a device file
 *
-* NOTE the %struct work_struct is embedded inside a %struct delayed_work.
-* This is embedded too inside a %struct pending_write_struct
+* @minor: pointer to %minor_struct representing the device file
+* @dst: buffer of the snapshot, NULL to only account the size
+* @cap: capacity of @dst
+* @now: jiffies when the snapshot started, expired messages are left out
+* @delayed: set to append the delayed posts of the sessions
+*
+* Returns the size of the snapshot
+*
+* NOTE The mutex of the device file must be held. Sessions are locked one at
+* a time, as in dev_flush()
+* NOTE The consumer groups follow the header. The read offsets of the
+* sessions are not saved, since sessions do not survive a reload
 */
-static void __deferred_write(struct work_struct *work_struct)
+static size_t __snapshot_minor(struct minor_struct *minor, char *dst,
+			       size_t cap, unsigned long now, bool delayed)
 {
-	int ret;
-	struct delayed_work *delayed_work;
-	struct pending_write_struct *pending_write;
-
-	delayed_work = container_of(work_struct, struct delayed_work, work);
-	pending_write = container_of(delayed_work, struct pending_write_struct,
-				     delayed_work);
-	/* Dequeue from the list of pending writes */
-	mutex_lock(&(pending_write->session->mtx));
-	list_del(&(pending_write->list));
-	mutex_unlock(&(pending_write->session->mtx));
+	size_t len = sizeof(struct snapshot_header);
+	struct snapshot_header header;
+	struct snapshot_group snapshot_group;
+	struct group_struct *group;
+	struct message_struct *msg;
+	struct session_struct *session;
 
-	mutex_lock(&(minors[pending_write->minor].mtx));
-	ret = __post_message(&minors[pending_write->minor],
-			     pending_write->kbuf, pending_write->len);
-	if (ret >= 0) {		/* message post succeeded */
-		__awake_pending_reader(&(minors[pending_write->minor]));
+	memset(&header, 0, sizeof(header));
+	list_for_each_entry(group, &(minor->groups), list) {
+		if (dst != NULL) {
+			memset(&snapshot_group, 0, sizeof(snapshot_group));
+			strscpy(snapshot_group.name, group->name,
+				GROUP_NAME_LEN);
+			snapshot_group.offset = group->offset;
+			memcpy(dst + len, &snapshot_group,
+			       sizeof(snapshot_group));
+		}
+		len += sizeof(struct snapshot_group);
+		header.groups++;
 	}
-	mutex_unlock(&(minors[pending_write->minor].mtx));
-
-	kfree(pending_write);
-	return;
+	if (dst != NULL) {
+		header.magic = SNAPSHOT_MAGIC;
+		header.version = SNAPSHOT_VERSION;
+		header.mode = minor->mode;
+		header.overflow_policy = minor->overflow_policy;
+		header.next_offset = minor->next_offset;
+		memcpy(dst, &header, sizeof(header));
+	}
+	list_for_each_entry(msg, &(minor->fifo), list) {
+		if (msg->ttl && !time_after(msg->expires, now)) {
+			continue;
+		}
+		len += __snapshot_record(dst ? dst + len : NULL, msg, 0,
+					 msg->ttl ? msg->expires - now : 0, 0);
+	}
+	if (!delayed) {
+		return len;
+	}
+	list_for_each_entry(session, &(minor->sessions), list) {
+		session_lock(session);
+		len = __snapshot_pending(dst, cap, len,
+					 &(session->pending_writes), now);
+		session_unlock(session);
+	}
+	return __snapshot_pending(dst, cap, len, &(minor->restored_writes),
+				  now);
 }
 
-static ssize_t dev_write(struct file *filep, const char *bufp, size_t len,
-			 loff_t * offp)
+/**
+* __snapshot_message - Restore a message of a snapshot
+*
+* @minor: pointer to %minor_struct representing the device file
+* @rec: pointer to the %snapshot_record of the message
+* @payload: payload of the message, @rec->size bytes
+*
+* Returns 1 if the message is stored, 0 if it is not (e.g. dropped by the
+* overflow policy) or its delayed post is queued, or a negative error code
+*
+* NOTE The mutex of the device file must be held
+* NOTE A stored message keeps its offset, below the %next_offset restored
+* from the header. Delayed posts are owned by the device file, since their
+* sessions are gone
+*/
+static int __snapshot_message(struct minor_struct *minor,
+			      struct snapshot_record *rec, const char *payload)
 {
-	char *kbuf;
-	int minor_idx, ret;
+	int ret;
+	unsigned long next_offset;
+	unsigned long long offset;
+	struct message_struct *msg;
 	struct pending_write_struct *pending_write;
-	struct session_struct *session;
-
-	session = (struct session_struct *)filep->private_data;
 
-	if (len > max_message_size) {
-		return -EMSGSIZE;
+	msg = __alloc_message(rec->raw_size, minor->node);
+	if (msg == NULL) {
+		return -ENOMEM;
 	}
-
-	/* Allocate a kernel buffer */
-	kbuf = kmalloc(len, GFP_KERNEL);
-	if (kbuf == NULL) {
+	msg->size = rec->size;
+	msg->buf = kmalloc_node(rec->size, GFP_KERNEL, minor->node);
+	if (msg->buf == NULL) {
+		kfree(msg);
 		return -ENOMEM;
 	}
-
-	/* Copy the message in the kernel buffer */
-	if (copy_from_user(kbuf, bufp, len)) {
-		kfree(kbuf);
-		return -EFAULT;
+	memcpy(msg->buf, payload, rec->size);
+	msg->keyed = !!(rec->flags & SNAPSHOT_KEYED);
+	msg->key = rec->key;
+	msg->tag = rec->tag;
+	if (rec->ttl) {
+		msg->ttl = max_t(unsigned long, nsecs_to_jiffies(rec->ttl), 1);
 	}
 
-	minor_idx = fminor(filep);
-
-	mutex_lock(&(session->mtx));
-	if (session->write_timeout) {	/* a write timeout exists */
-		/* Allocate a pending_write_struct */
-		pending_write = kmalloc(sizeof(struct pending_write_struct),
-					GFP_KERNEL);
-		if (pending_write == NULL) {
-			kfree(kbuf);
-			mutex_unlock(&(session->mtx));
-			return -ENOMEM;
-		}
-		/* Initialize the pending_write_struct */
-		pending_write->minor = minor_idx;
-		pending_write->session = session;
-		pending_write->kbuf = kbuf;
-		pending_write->len = len;
-		INIT_LIST_HEAD(&(pending_write->list));
-		INIT_DELAYED_WORK(&(pending_write->delayed_work),
-				  __deferred_write);
-		/* Enqueue the pending write to the list of the others */
-		list_add_tail(&(pending_write->list),
-			      &(session->pending_writes));
-		mutex_unlock(&(session->mtx));
-		queue_delayed_work(session->write_wq,
-				   &(pending_write->delayed_work),
-				   session->write_timeout);
-		return 0;	/* no byte actually written */
+	if (!(rec->flags & SNAPSHOT_DELAYED)) {
+		/* Post at the offset of the record, then put next_offset back */
+		next_offset = minor->next_offset;
+		WRITE_ONCE(minor->next_offset, rec->offset);
+		ret = __post_message(minor, msg, &offset);
+		WRITE_ONCE(minor->next_offset, next_offset);
+		return ret < 0 ? ret : offset != COMPLETION_NO_OFFSET;
 	}
 
-	mutex_unlock(&(session->mtx));
-
-	/* Immediate storing */
-	mutex_lock(&(minors[minor_idx].mtx));
-	ret = __post_message(&minors[minor_idx], kbuf, len);
-	if (ret >= 0) {		/* message post succeeded */
-		__awake_pending_reader(&(minors[minor_idx]));
+	pending_write = kmalloc(sizeof(struct pending_write_struct),
+				GFP_KERNEL);
+	if (pending_write == NULL) {
+		__free_message(msg);
+		return -ENOMEM;
 	}
-	mutex_unlock(&(minors[minor_idx].mtx));
-
-	return ret;
+	msg->scheduled = ktime_get();
+	pending_write->minor = minor - minors;
+	pending_write->session = NULL;
+	pending_write->msg = msg;
+	pending_write->seq = 0;
+	INIT_DELAYED_WORK(&(pending_write->delayed_work), __deferred_write);
+	list_add_tail(&(pending_write->list), &(minor->restored_writes));
+	queue_delayed_work(restore_wq, &(pending_write->delayed_work),
+			   nsecs_to_jiffies(rec->delay));
+	return 0;
 }
 
 /**
-* __revoke_delayed_messages - Cancel delayed write of an I/O session
+* __snapshot_groups - Restore the consumer groups of a snapshot
 *
-* @session: pointer to %struct session_struct representing the I/O session
+* @minor: pointer to %minor_struct representing the device file
+* @groups: the %snapshot_group entries
+* @nr: number of entries
+* @next_offset: %next_offset of the snapshot
+*
+* Returns 0 on success, %-EINVAL if an entry is malformed, or the error of
+* __add_group()
 *
+* NOTE The mutex of the device file must be held. Existing groups take the
+* offset of the snapshot
 */
-static void __revoke_delayed_messages(struct session_struct *session)
+static int __snapshot_groups(struct minor_struct *minor,
+			     struct snapshot_group *groups, unsigned int nr,
+			     unsigned long next_offset)
 {
-	struct list_head *ptr;
-	struct list_head *tmp;
-	struct pending_write_struct *pending_write;
-
-	list_for_each_safe(ptr, tmp, &(session->pending_writes)) {
-		pending_write = list_entry(ptr, struct pending_write_struct,
-					   list);
+	unsigned int i;
+	size_t name_len;
+	struct group_struct *group;
 
-		/* NOTE that the pending write may be actually already in execution
-		   thus we have to check return value */
-		if (cancel_delayed_work(&(pending_write->delayed_work))) {
-			list_del(&(pending_write->list));
-			kfree(pending_write->kbuf);
-			kfree(pending_write);
+	for (i = 0; i < nr; i++) {
+		name_len = strnlen(groups[i].name, GROUP_NAME_LEN);
+		if (name_len == 0 || name_len == GROUP_NAME_LEN
+		    || groups[i].offset > next_offset) {
+			return -EINVAL;
+		}
+		group = __add_group(minor, groups[i].name, groups[i].offset);
+		if (IS_ERR(group)) {
+			return PTR_ERR(group);
 		}
+		group->offset = groups[i].offset;
 	}
+	return 0;
 }
 
-static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+/**
+* __snapshot_restore - Load the complete records buffered by a restore
+*
+* @state: pointer to the %snapshot_state of the restore
+*
+* Returns 0, leaving in the buffer the bytes of an incomplete record, or a
+* negative error code: %-EINVAL if the snapshot is malformed, %-EBUSY if
+* the device file stores messages when the header is loaded, %-EMSGSIZE if
+* a payload exceeds max_message_size, or the error of a post
+*
+* NOTE Blocked readers are awaken once per call, not once per message
+* NOTE The header is applied with the consumer groups that follow it, and
+* %next_offset is set back to the one of the snapshot, so that offsets are
+* neither reused nor skipped even if the tail of the log was consumed
+*/
+static int __snapshot_restore(struct snapshot_state *state)
 {
-	struct session_struct *session;
-
-	session = (struct session_struct *)filep->private_data;
+	int ret = 0;
+	unsigned int posted = 0;
+	size_t pos = 0, max_size, groups_len;
+	struct snapshot_header header;
+	struct snapshot_record rec;
+	struct minor_struct *minor = state->minor;
 
-	switch (cmd) {
-	case SET_SEND_TIMEOUT:
-		mutex_lock(&(session->mtx));
-		session->write_timeout = (arg * HZ) / 1000;
-		mutex_unlock(&(session->mtx));
-		break;
-	case SET_RECV_TIMEOUT:
-		mutex_lock(&(session->mtx));
-		session->read_timeout = (arg * HZ) / 1000;
-		mutex_unlock(&(session->mtx));
-		break;
-	case REVOKE_DELAYED_MESSAGES:
-		mutex_lock(&(session->mtx));
-		__revoke_delayed_messages(session);
-		mutex_unlock(&(session->mtx));
-		break;
-	default:
-		printk(KERN_INFO "%s: ioctl() command not valid\n", MODNAME);
-		return -ENOTTY;
+	max_size = state->size - sizeof(header) -
+	    MAX_GROUPS * sizeof(struct snapshot_group) - sizeof(rec);
+	minor_lock(minor);
+	if (!state->loaded_header) {
+		if (state->len < sizeof(header)) {
+			goto out;
+		}
+		memcpy(&header, state->buf, sizeof(header));
+		if (header.magic != SNAPSHOT_MAGIC
+		    || header.version != SNAPSHOT_VERSION
+		    || header.overflow_policy > OVERFLOW_DROP_NEW
+		    || header.groups > MAX_GROUPS
+		    || header.next_offset > ULONG_MAX) {
+			ret = -EINVAL;
+			goto out;
+		}
+		if (!list_empty(&(minor->fifo))
+		    || !list_empty(&(minor->restored_writes))) {
+			ret = -EBUSY;
+			goto out;
+		}
+		groups_len = header.groups * sizeof(struct snapshot_group);
+		if (state->len < sizeof(header) + groups_len) {
+			goto out;
+		}
+		ret = __set_minor_mode(minor, header.mode);
+		if (ret < 0) {
+			goto out;
+		}
+		ret = __snapshot_groups(minor, (struct snapshot_group *)
+					(state->buf + sizeof(header)),
+					header.groups, header.next_offset);
+		if (ret < 0) {
+			goto out;
+		}
+		minor->overflow_policy = header.overflow_policy;
+		WRITE_ONCE(minor->next_offset, header.next_offset);
+		state->next_offset = header.next_offset;
+		state->min_offset = 0;
+		state->loaded_header = 1;
+		pos = sizeof(header) + groups_len;
 	}
-	return 0;
+	while (state->len - pos >= sizeof(rec)) {
+		memcpy(&rec, state->buf + pos, sizeof(rec));
+		if ((rec.flags & ~SNAPSHOT_MASK) || rec.tag >= MSG_TAGS
+		    || !(rec.flags & SNAPSHOT_COMPRESSED) !=
+		    (rec.size == rec.raw_size)) {
+			ret = -EINVAL;
+			break;
+		}
+		/* Stored messages come with increasing offsets */
+		if (!(rec.flags & SNAPSHOT_DELAYED)
+		    && (rec.offset < state->min_offset
+			|| rec.offset >= state->next_offset)) {
+			ret = -EINVAL;
+			break;
+		}
+		if (rec.size > max_size || rec.raw_size > max_size) {
+			ret = -EMSGSIZE;
+			break;
+		}
+		if (state->len - pos - sizeof(rec) < rec.size) {
+			break;
+		}
+		ret = __snapshot_message(minor, &rec,
+					 state->buf + pos + sizeof(rec));
+		if (ret < 0) {
+			break;
+		}
+		if (!(rec.flags & SNAPSHOT_DELAYED)) {
+			state->min_offset = rec.offset + 1;
+		}
+		posted += ret;
+		pos += sizeof(rec) + rec.size;
+	}
+out:
+	if (posted) {
+		__messages_posted(minor, posted);
+	}
+	minor_unlock(minor);
+	state->len -= pos;
+	memmove(state->buf, state->buf + pos, state->len);
+	return ret < 0 ? ret : 0;
 }
 
 /**
-* __unblock_reads - Unblock readers waiting for messages
-*
-* @minor: pointer to %struct minor_struct representing the target device file
+* snapshot_open - Open the snapshot of a device file
 *
+* NOTE Readers get the content of the device file at open time. Writers
+* restore a snapshot in the device file, that must store no message.
+* Opening for both reading and writing is not allowed
+* NOTE The dump is allocated out of the mutex of the device file, once sized,
+* and sized again if the device file grew in the meantime
 */
-static void __unblock_reads(struct minor_struct *minor)
+static int snapshot_open(struct inode *inode, struct file *file)
 {
-	struct list_head *ptr;
-	struct list_head *tmp;
-	struct pending_read_struct *pending_read;
+	bool delayed;
+	size_t size = 0, needed;
+	unsigned long now;
+	struct snapshot_state *state;
+	struct minor_struct *minor = inode->i_private;
 
-	list_for_each_safe(ptr, tmp, &(minor->pending_reads)) {
-		pending_read = list_entry(ptr, struct pending_read_struct,
-					  list);
-		pending_read->flushing = 1;
-		list_del(&(pending_read->list));
-		wake_up_interruptible(&(minor->read_wq));
+	if ((file->f_mode & FMODE_READ) && (file->f_mode & FMODE_WRITE)) {
+		return -EINVAL;
+	}
+	state = kzalloc(sizeof(struct snapshot_state), GFP_KERNEL);
+	if (state == NULL) {
+		return -ENOMEM;
+	}
+	state->minor = minor;
+	if (file->f_mode & FMODE_WRITE) {
+		/* Room for the header, the groups and one record */
+		state->size = sizeof(struct snapshot_header) +
+		    MAX_GROUPS * sizeof(struct snapshot_group) +
+		    sizeof(struct snapshot_record) + READ_ONCE(max_message_size);
+		state->buf = kvmalloc(state->size, GFP_KERNEL);
+	} else {
+		delayed = READ_ONCE(snapshot_delayed);
+		minor_lock(minor);
+		for (;;) {
+			now = jiffies;
+			needed = __snapshot_minor(minor, NULL, SIZE_MAX, now,
+						  delayed);
+			if (needed <= size) {
+				break;
+			}
+			minor_unlock(minor);
+			kvfree(state->buf);
+			size = needed;
+			state->buf = kvmalloc(size, GFP_KERNEL);
+			minor_lock(minor);
+			if (state->buf == NULL) {
+				break;
+			}
+		}
+		if (state->buf != NULL) {
+			state->len = __snapshot_minor(minor, state->buf, size,
+						      now, delayed);
+		}
+		minor_unlock(minor);
+	}
+	if (state->buf == NULL) {
+		kfree(state);
+		return -ENOMEM;
 	}
+	file->private_data = state;
+	return 0;
 }
 
-static int dev_flush(struct file *filep, fl_owner_t id)
+static ssize_t snapshot_read(struct file *file, char __user *bufp,
+			     size_t len, loff_t *offp)
 {
-	int minor_idx;
-	struct list_head *ptr;
-	struct session_struct *session;
-
-	minor_idx = fminor(filep);
-	mutex_lock(&(minors[minor_idx].mtx));
-	/* Revoke delayed writes */
-	list_for_each(ptr, &(minors[minor_idx].sessions)) {
-		session = list_entry(ptr, struct session_struct, list);
-		mutex_lock(&(session->mtx));
-		__revoke_delayed_messages(session);
-		mutex_unlock(&(session->mtx));
-	}
-	/* Readers waiting for messages are unblocked */
-	__unblock_reads(&(minors[minor_idx]));
-	mutex_unlock(&(minors[minor_idx].mtx));
+	struct snapshot_state *state = file->private_data;
 
-	return 0;
+	return simple_read_from_buffer(bufp, len, offp, state->buf,
+				       state->len);
 }
 
-static int dev_release(struct inode *inodep, struct file *filep)
+/**
+* snapshot_write - Restore a snapshot in a device file
+*
+* NOTE The snapshot can be written in chunks of any size. Records are loaded
+* as soon as they are complete, so an error leaves the device file with the
+* records before the failing one
+*/
+static ssize_t snapshot_write(struct file *file, const char __user *bufp,
+			      size_t len, loff_t *offp)
 {
-	struct session_struct *session_struct;
-	int minor_idx;
+	int ret;
+	size_t chunk, done = 0;
+	struct snapshot_state *state = file->private_data;
 
-	session_struct = (struct session_struct *)filep->private_data;
-	/* Wait for delayed write in execution to complete */
-	flush_workqueue(session_struct->write_wq);
-	destroy_workqueue(session_struct->write_wq);
-	/* Unlink session_struct from minor_struct */
-	minor_idx = iminor(inodep);
-	mutex_lock(&(minors[minor_idx].mtx));
-	list_del(&(session_struct->list));
-	mutex_unlock(&(minors[minor_idx].mtx));
+	if (state->error) {
+		return state->error;
+	}
+	while (done < len) {
+		chunk = min(len - done, state->size - state->len);
+		if (copy_from_user(state->buf + state->len, bufp + done,
+				   chunk)) {
+			state->error = -EFAULT;
+			return -EFAULT;
+		}
+		state->len += chunk;
+		done += chunk;
+		ret = __snapshot_restore(state);
+		if (ret < 0) {
+			state->error = ret;
+			return ret;
+		}
+	}
+	*offp += len;
+	return len;
+}
 
-	kfree(session_struct);
+static int snapshot_release(struct inode *inode, struct file *file)
+{
+	struct snapshot_state *state = file->private_data;
 
+	if (state->len && !state->error && (file->f_mode & FMODE_WRITE)) {
+		printk(KERN_INFO "%s: Truncated snapshot of minor %ld\n",
+		       MODNAME, (long)(state->minor - minors));
+	}
+	kvfree(state->buf);
+	kfree(state);
 	return 0;
 }
 
+static const struct file_operations snapshot_fops = {
+	.owner = THIS_MODULE,
+	.open = snapshot_open,
+	.read = snapshot_read,
+	.write = snapshot_write,
+	.llseek = default_llseek,
+	.release = snapshot_release,
+};
+
 static struct file_operations fops = {
 	.owner = THIS_MODULE,
 	.open = dev_open,
@@ -474,29 +4232,167 @@ static struct file_operations fops = {
 	.read = dev_read,
 	.write = dev_write,
 	.unlocked_ioctl = dev_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	/* Arguments have the same layout for 32-bit tasks */
+	.compat_ioctl = compat_ptr_ioctl,
+#endif
+	.poll = dev_poll,
+	.fasync = dev_fasync,
 	.flush = dev_flush,
 };
 
+/**
+* __init_minor - Initialize a device file with no message and no session
+*
+* @minor: pointer to %minor_struct representing the device file
+*
+*/
+static void __init_minor(struct minor_struct *minor)
+{
+	int j;
+
+	minor->current_size = 0;
+	minor->msg_count = 0;
+	minor->mode = 0;
+	minor->node = NUMA_NO_NODE;
+	minor->overflow_policy = OVERFLOW_REJECT;
+	minor->dropped_oldest = 0;
+	minor->dropped_new = 0;
+	minor->rejected_batches = 0;
+	minor->conflated = 0;
+	minor->compressed = 0;
+	minor->compress_saved = 0;
+	hash_init(minor->keys);
+	hash_init(minor->calls);
+	minor->orphan_replies = 0;
+	minor->fasync = NULL;
+	minor->eventfds = 0;
+	for (j = 0; j < PARTITIONS; j++) {
+		INIT_LIST_HEAD(&(minor->partitions[j]));
+		minor->partition_count[j] = 0;
+		minor->partition_bytes[j] = 0;
+		minor->partition_owner[j] = NULL;
+	}
+	INIT_LIST_HEAD(&(minor->consumers));
+	minor->nr_consumers = 0;
+	for (j = 0; j < MSG_TAGS; j++) {
+		INIT_LIST_HEAD(&(minor->tags[j]));
+		minor->tag_count[j] = 0;
+		minor->tag_bytes[j] = 0;
+		xa_init(&(minor->tag_log[j]));
+		minor->tag_posted[j] = 0;
+	}
+	minor->next_offset = 0;
+	mutex_init(&(minor->mtx));
+	plist_head_init(&(minor->pending_reads));
+	init_waitqueue_head(&(minor->read_wq));
+	INIT_LIST_HEAD(&(minor->fifo));
+	INIT_LIST_HEAD(&(minor->expiry));
+	INIT_LIST_HEAD(&(minor->restored_writes));
+	INIT_DELAYED_WORK(&(minor->sweep_work), __sweep_expired);
+	minor->expired_on_read = 0;
+	minor->expired_by_sweep = 0;
+	atomic_long_set(&(minor->busy_poll_hits), 0);
+	atomic_long_set(&(minor->busy_poll_misses), 0);
+	memset(minor->latency_hist, 0, sizeof(minor->latency_hist));
+#ifdef TIMED_MSG_LOCK_STATS
+	memset(minor->lock_stats, 0, sizeof(minor->lock_stats));
+#endif
+	xa_init(&(minor->log));
+	INIT_LIST_HEAD(&(minor->groups));
+	INIT_LIST_HEAD(&(minor->sessions));
+}
+
+/**
+* __clear_minor - Deallocate the messages and the groups of a device file
+*
+* @minor: pointer to %minor_struct representing the device file
+*
+*/
+static void __clear_minor(struct minor_struct *minor)
+{
+	int j;
+	struct list_head *ptr;
+	struct list_head *tmp;
+	struct message_struct *msg;
+	struct group_struct *group;
+	struct pending_write_struct *pending_write;
+
+	/* Restored writes not yet running are revoked, the others flushed */
+	minor_lock(minor);
+	list_for_each_safe(ptr, tmp, &(minor->restored_writes)) {
+		pending_write = list_entry(ptr, struct pending_write_struct,
+					   list);
+		if (cancel_delayed_work(&(pending_write->delayed_work))) {
+			list_del(&(pending_write->list));
+			__free_message(pending_write->msg);
+			kfree(pending_write);
+		}
+	}
+	minor_unlock(minor);
+	flush_workqueue(restore_wq);
+
+	cancel_delayed_work_sync(&(minor->sweep_work));
+	//mutex_lock(&(minor->mtx));
+	/* Flush content of the device files */
+	list_for_each_safe(ptr, tmp, &(minor->fifo)) {
+		msg = list_entry(ptr, struct message_struct, list);
+		list_del(&(msg->list));
+		__free_message(msg);
+	}
+	xa_destroy(&(minor->log));
+	for (j = 0; j < MSG_TAGS; j++) {
+		xa_destroy(&(minor->tag_log[j]));
+	}
+	list_for_each_safe(ptr, tmp, &(minor->groups)) {
+		group = list_entry(ptr, struct group_struct, list);
+		list_del(&(group->list));
+		kfree(group);
+	}
+	//mutex_unlock(&(minor->mtx));
+}
+
 static int __init install_driver(void)
 {
 	int i;
+	char name[16];
+	struct dentry *minor_dir;
 
 	/* Initialization of minor_struct array */
 	for (i = 0; i < MINORS; i++) {
-		minors[i].current_size = 0;
-		mutex_init(&(minors[i].mtx));
-		INIT_LIST_HEAD(&(minors[i].pending_reads));
-		init_waitqueue_head(&(minors[i].read_wq));
-		INIT_LIST_HEAD(&(minors[i].fifo));
-		INIT_LIST_HEAD(&(minors[i].sessions));
+		__init_minor(&(minors[i]));
+	}
+	release_ref_ns = ktime_get_ns();
+	release_ref_jiffies = get_jiffies_64();
+	restore_wq = alloc_workqueue(RESTORE_WORK_QUEUE, WQ_MEM_RECLAIM, 0);
+	if (restore_wq == NULL) {
+		return -ENOMEM;
 	}
 
 	/* Driver registration */
 	major = __register_chrdev(0, 0, MINORS, DEVICE_NAME, &fops);
 	if (major < 0) {
 		printk(KERN_INFO "%s: Driver installation failed\n", MODNAME);
+		destroy_workqueue(restore_wq);
 		return major;
 	}
+
+	/* Statistics are exported via debugfs, one directory per minor */
+	debugfs_root = debugfs_create_dir(DEVICE_NAME, NULL);
+	for (i = 0; i < MINORS; i++) {
+		snprintf(name, sizeof(name), "%d", i);
+		minor_dir = debugfs_create_dir(name, debugfs_root);
+		debugfs_create_file("stats", S_IRUGO, minor_dir, &(minors[i]),
+				    &stats_fops);
+		debugfs_create_file("latency", S_IRUGO, minor_dir,
+				    &(minors[i]), &latency_fops);
+		debugfs_create_file("snapshot", S_IRUSR | S_IWUSR, minor_dir,
+				    &(minors[i]), &snapshot_fops);
+#ifdef TIMED_MSG_LOCK_STATS
+		debugfs_create_file("locks", S_IRUGO | S_IWUSR, minor_dir,
+				    &(minors[i]), &locks_fops);
+#endif
+	}
 	printk(KERN_INFO "%s: Driver correctly installed, MAJOR = %d\n",
 	       MODNAME, major);
 	return 0;
@@ -506,21 +4402,13 @@ static int __init install_driver(void)
 static void __exit uninstall_driver(void)
 {
 	int i;
-	struct list_head *ptr;
-	struct list_head *tmp;
-	struct message_struct *msg;
+
+	debugfs_remove_recursive(debugfs_root);
 
 	for (i = 0; i < MINORS; i++) {
-		//mutex_lock(&(minors[i].mtx));
-		/* Flush content of the device files */
-		list_for_each_safe(ptr, tmp, &(minors[i].fifo)) {
-			msg = list_entry(ptr, struct message_struct, list);
-			list_del(&(msg->list));
-			kfree(msg->buf);
-			kfree(msg);
-		}
-		//mutex_unlock(&(minors[i].mtx));
+		__clear_minor(&(minors[i]));
 	}
+	destroy_workqueue(restore_wq);
 
 	/* Driver unregistration */
 	unregister_chrdev(major, DEVICE_NAME);
@@ -535,3 +4423,8 @@ MODULE_AUTHOR("Federico Viglietta");
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION
     ("This module provides a device file that allows exchanging messages across threads");
+
+/* The KUnit suite drives the static helpers above */
+#ifdef TIMED_MSG_KUNIT
+#include "test/kunit/timed-msg-system-test.c"
+#endif
@@ -1,4 +1,5 @@
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 /******************************ioctl() commands*********************************/
 
@@ -6,6 +7,259 @@
 #define SET_SEND_TIMEOUT _IO(MAGIC_BASE, 0)
 #define SET_RECV_TIMEOUT _IO(MAGIC_BASE, 1)
 #define REVOKE_DELAYED_MESSAGES _IO(MAGIC_BASE, 2)
+#define SET_MINOR_MODE _IO(MAGIC_BASE, 3)
+#define SEEK_OFFSET _IO(MAGIC_BASE, 4)
+#define GET_OFFSET _IOR(MAGIC_BASE, 5, unsigned long long)
+#define JOIN_GROUP _IOW(MAGIC_BASE, 6, char[GROUP_NAME_LEN])
+#define LEAVE_GROUP _IO(MAGIC_BASE, 7)
+#define SET_MSG_TTL _IO(MAGIC_BASE, 8)
+#define SET_RCVLOWAT _IOW(MAGIC_BASE, 9, struct rcvlowat_struct)
+#define SET_BUSY_POLL_US _IO(MAGIC_BASE, 10)
+#define SET_WRITE_AFFINITY _IOW(MAGIC_BASE, 11, struct write_affinity_struct)
+#define SET_MINOR_NODE _IO(MAGIC_BASE, 12)
+#define SET_READ_HEADER _IO(MAGIC_BASE, 13)
+#define SET_OVERFLOW_POLICY _IO(MAGIC_BASE, 14)
+#define SET_WRITE_HEADER _IO(MAGIC_BASE, 15)
+#define SET_ZEROCOPY _IO(MAGIC_BASE, 16)
+#define GET_COMPLETION _IOR(MAGIC_BASE, 17, struct completion_struct)
+#define SET_TAG_FILTER _IOW(MAGIC_BASE, 18, unsigned long long)
+#define CALL _IOWR(MAGIC_BASE, 19, struct call_struct)
+#define SET_CONSUMER _IO(MAGIC_BASE, 20)
+#define SET_RATE_LIMIT _IOW(MAGIC_BASE, 21, struct rate_limit_struct)
+#define SET_READ_PRIORITY _IO(MAGIC_BASE, 22)
+#define SET_POST_COMPLETIONS _IO(MAGIC_BASE, 23)
+#define CORK _IOW(MAGIC_BASE, 24, struct cork_struct)
+#define UNCORK _IO(MAGIC_BASE, 25)
+#define PEEK_SIZE _IO(MAGIC_BASE, 26)
+#define PEEK _IOWR(MAGIC_BASE, 27, struct peek_struct)
+#define SET_STRICT_READ _IO(MAGIC_BASE, 28)
+#define REGISTER_EVENTFD _IO(MAGIC_BASE, 29)
+#define DELETE_GROUP _IOW(MAGIC_BASE, 30, char[GROUP_NAME_LEN])
+#define REGISTER_COMPLETION_EVENTFD _IO(MAGIC_BASE, 31)
+
+/********************************Minor modes************************************/
+
+#define MINOR_MODE_RETAIN 0x1  /* Messages are kept after read (log mode) */
+#define MINOR_MODE_CONFLATE 0x2 /* Only the latest message per key is kept */
+#define MINOR_MODE_COMPRESS 0x4 /* Large payloads are stored LZ4-compressed */
+#define MINOR_MODE_PARTITION 0x8 /* Keys are delivered to owner consumers */
+#define MINOR_MODE_MASK (MINOR_MODE_RETAIN | MINOR_MODE_CONFLATE | \
+			 MINOR_MODE_COMPRESS | MINOR_MODE_PARTITION)
+
+#define PARTITION_BITS 4        /* Keys are hashed to 2^4 partitions */
+#define PARTITIONS (1 << PARTITION_BITS)
+
+/*****************************Overflow policies*********************************/
+
+#define OVERFLOW_REJECT 0       /* The post fails with -ENOSPC (default) */
+#define OVERFLOW_DROP_OLDEST 1  /* The oldest messages are discarded */
+#define OVERFLOW_DROP_NEW 2     /* The new message is silently discarded */
+
+#define GROUP_NAME_LEN 32      /* Including the terminating null byte */
+
+/******************************Read header**************************************/
+
+/**
+* read_header_struct - Prepended to messages read with SET_READ_HEADER
+*
+* Timestamps are CLOCK_MONOTONIC nanoseconds
+*/
+struct read_header_struct {
+	long long posted;         /* When the message was stored */
+	long long scheduled;      /* When the delayed write() was called, 0 if
+				     the write was immediate */
+	unsigned long long offset; /* Sequence number of the message, gaps
+				      reveal messages discarded by overflow
+				      policies or expired */
+	unsigned long long key;   /* Key of the message, 0 if not keyed */
+	unsigned int size;        /* Size of the whole message */
+	unsigned int tag;         /* Tag of the message, 0 if not tagged */
+	unsigned long long corr_id; /* Correlation ID of a CALL request */
+};
+
+/**
+* peek_struct - Argument of PEEK
+*/
+struct peek_struct {
+	__u64 buf;                /* User address of the buffer receiving the
+				     message, as read() */
+	unsigned int len;         /* Size of the buffer */
+	unsigned int size;        /* Set to the payload size of the message */
+};
+
+/******************************Write header*************************************/
+
+#define WRITE_HEADER_KEY 0x1    /* The key field is valid */
+#define WRITE_HEADER_TAG 0x2    /* The tag field is valid */
+#define WRITE_HEADER_REPLY 0x4  /* Reply to the CALL with corr_id */
+#define WRITE_HEADER_DELAY 0x8  /* Post after release nanoseconds */
+#define WRITE_HEADER_RELEASE 0x10 /* Post at release (CLOCK_MONOTONIC ns) */
+#define WRITE_HEADER_MASK (WRITE_HEADER_KEY | WRITE_HEADER_TAG | \
+			   WRITE_HEADER_REPLY | WRITE_HEADER_DELAY | \
+			   WRITE_HEADER_RELEASE)
+
+#define MSG_TAGS 64             /* Tags range in [0, MSG_TAGS) */
+#define TAG_FILTER_ALL (~0ULL)  /* Default filter: bit i set reads tag i */
+
+/**
+* write_header_struct - Prepended to messages written with SET_WRITE_HEADER
+*/
+struct write_header_struct {
+	unsigned int flags;       /* WRITE_HEADER_* */
+	unsigned int tag;         /* Tag matched by the filters of readers */
+	unsigned long long key;   /* Key used in conflating mode */
+	unsigned long long corr_id; /* Correlation ID, with WRITE_HEADER_REPLY */
+	unsigned long long release; /* Delay or release time, overriding the
+				       write timeout of the session */
+};
+
+/******************************Request/reply************************************/
+
+/**
+* call_struct - Argument of CALL
+*/
+struct call_struct {
+	__u64 request;            /* User address of the request, posted to the
+				     device file */
+	__u64 reply;              /* User address of the buffer receiving the
+				     reply */
+	unsigned int request_len;
+	unsigned int reply_len;   /* Size of the reply buffer */
+	unsigned int reply_minor; /* Minor where the reply is posted */
+	unsigned int timeout;     /* Milliseconds, 0 is not valid */
+	unsigned long long corr_id; /* Set by the driver */
+};
+
+/******************************Completions**************************************/
+
+#define COMPLETION_ZEROCOPY 1   /* The buffer of a zerocopy write is released */
+#define COMPLETION_POST 2       /* A deferred write is posted or given up */
+#define COMPLETION_BATCH 3      /* A batch published by the latency bound of
+				   a cork is discarded */
+
+#define COMPLETION_NO_OFFSET (~0ULL) /* The message was not stored */
+
+/**
+* completion_struct - Outcome of an asynchronous operation, see GET_COMPLETION
+*/
+struct completion_struct {
+	unsigned int type;        /* COMPLETION_* */
+	int status;               /* 0 if the message was delivered, else -errno */
+	unsigned long long cookie; /* Address of the written buffer (ZEROCOPY),
+				      sequence number of the write (POST) or
+				      messages of the batch (BATCH) */
+	unsigned long long offset; /* Offset of the message, if it was posted */
+};
+
+/*******************************Read priority***********************************/
+
+#define READ_PRIO_TASK -1       /* Blocked readers use their task priority */
+#define READ_PRIO_LEVELS 140    /* Same scale of task priorities: 0-99 are
+				   real-time, 100-139 normal (120 is nice 0) */
+
+/*******************************Rate limiting***********************************/
+
+#define RATE_LIMIT_REJECT 0     /* write() fails with -EAGAIN */
+#define RATE_LIMIT_DELAY 1      /* The post is delayed until tokens refill,
+				   -EAGAIN past one burst of debt */
+
+/**
+* rate_limit_struct - Token buckets of the writes of a session (SET_RATE_LIMIT)
+*/
+struct rate_limit_struct {
+	unsigned int msgs_per_sec;  /* 0 means no limit */
+	unsigned int bytes_per_sec; /* 0 means no limit */
+	unsigned int burst_msgs;    /* Bucket sizes, 0 means one second of rate */
+	unsigned int burst_bytes;
+	int action;                 /* RATE_LIMIT_* */
+};
+
+/*********************************Corking***************************************/
+
+/**
+* cork_struct - Bounds of the batch staged by a corked session (CORK)
+*/
+struct cork_struct {
+	unsigned int max_msgs;      /* 0 means no bound */
+	unsigned int max_bytes;     /* 0 means max_storage_size, not above it */
+	unsigned int max_latency;   /* Milliseconds, 0 means no bound */
+};
+
+/****************************Deferred write affinity****************************/
+
+#define WRITE_AFFINITY_NONE 0   /* Any CPU */
+#define WRITE_AFFINITY_WRITER 1 /* CPU that called write() */
+#define WRITE_AFFINITY_CPU 2    /* The CPU given as target */
+#define WRITE_AFFINITY_NODE 3   /* A CPU of the NUMA node given as target, or
+				   of the device file node if target is -1 */
+
+/**
+* write_affinity_struct - Where deferred writes run (SET_WRITE_AFFINITY)
+*/
+struct write_affinity_struct {
+	int policy;               /* WRITE_AFFINITY_* */
+	int target;               /* CPU or NUMA node, according to policy */
+};
+
+/**
+* rcvlowat_struct - Low watermark of blocked readers (SET_RCVLOWAT)
+*/
+struct rcvlowat_struct {
+	unsigned int msgs;        /* Messages to wait for, at least 1 */
+	unsigned int bytes;       /* Stored bytes to wait for, 0 to disable, not
+				     valid in retained mode */
+	unsigned int max_latency; /* Milliseconds, 0 to disable */
+};
+
+/*********************************Snapshots*************************************/
+
+#define SNAPSHOT_MAGIC 0x544d5353 /* "SSMT" as little endian bytes */
+#define SNAPSHOT_VERSION 2
+
+#define SNAPSHOT_KEYED 0x1      /* The key field is valid */
+#define SNAPSHOT_COMPRESSED 0x2 /* The payload is LZ4-compressed */
+#define SNAPSHOT_DELAYED 0x4    /* A delayed post, not yet stored */
+#define SNAPSHOT_MASK (SNAPSHOT_KEYED | SNAPSHOT_COMPRESSED | SNAPSHOT_DELAYED)
+
+/**
+* snapshot_header - First bytes of the snapshot of a device file
+*/
+struct snapshot_header {
+	unsigned int magic;       /* SNAPSHOT_MAGIC */
+	unsigned int version;     /* SNAPSHOT_VERSION */
+	unsigned int mode;        /* MINOR_MODE_* */
+	unsigned int overflow_policy; /* OVERFLOW_* */
+	unsigned long long next_offset; /* Offset of the next posted message */
+	unsigned int groups;      /* snapshot_group entries following the header,
+				     up to MAX_GROUPS */
+	unsigned int pad;
+};
+
+/**
+* snapshot_group - A consumer group in a snapshot, following the header
+*/
+struct snapshot_group {
+	char name[GROUP_NAME_LEN]; /* Null-terminated */
+	unsigned long long offset; /* Next offset to be read by the group */
+};
+
+/**
+* snapshot_record - A message in a snapshot, followed by size payload bytes
+*
+* Stored messages come first, in FIFO order (increasing offsets below
+* next_offset), then the delayed posts
+*/
+struct snapshot_record {
+	unsigned int flags;       /* SNAPSHOT_* */
+	unsigned int tag;
+	unsigned int size;        /* Payload bytes following the record */
+	unsigned int raw_size;    /* Uncompressed size, equal to size if the
+				     payload is not compressed */
+	unsigned long long offset; /* Offset of a stored message */
+	unsigned long long key;
+	unsigned long long ttl;   /* Remaining time to live (ns), 0 forever */
+	unsigned long long delay; /* Remaining delay (ns) of a delayed post */
+};
 
 /**********************************kernel part**********************************/
 
@@ -16,17 +270,92 @@
 #define MINORS 3
 #define MAX_MSG_SIZE_DEFAULT 4096      /* bytes */
 #define MAX_STORAGE_SIZE_DEFAULT 65536 /* bytes */
+#define COMPRESS_THRESHOLD_DEFAULT 256 /* bytes */
 #define WRITE_WORK_QUEUE "wq-timed-msg-system"
+#define RESTORE_WORK_QUEUE "wq-timed-msg-restore"
+#define MAX_GROUPS 16                  /* Consumer groups per minor */
+#define TTL_SWEEP_INTERVAL HZ          /* Minimum jiffies between two sweeps */
+#define TTL_SWEEP_BATCH 64             /* Expired messages freed per lock hold */
+#define BUSY_POLL_MAX_US 10000         /* Upper bound of SET_BUSY_POLL_US */
+#define BUSY_POLL_MIN_DIVISOR 8        /* Adaptive spin floor: busy_poll_us / 8 */
+#define LATENCY_BUCKETS 64             /* log2 buckets of the delay histogram */
+#define KEY_HASH_BITS 8                /* Buckets of the key index: 2^8 */
+#define COMPLETION_RING 64             /* Completions queued per session */
+#define CALL_HASH_BITS 6               /* Buckets of the pending calls: 2^6 */
+#define LOCK_SITES 64                  /* Lock sites profiled (LOCK_STATS) */
 
 /******************************Data Structures**********************************/
 
+#ifdef TIMED_MSG_LOCK_STATS
+/**
+* lock_site - Place of the source where a mutex is acquired
+*/
+struct lock_site {
+	const char *lock;               /* "minor" or "session" */
+	const char *func;
+	unsigned int line;
+	int id;                         /* Index in lock_stats, -1 if unused */
+};
+
+/**
+* lock_stat - Contention of the mutexes of a device file at a lock site
+*/
+struct lock_stat {
+	atomic64_t acquired;
+	atomic64_t contended;           /* Acquisitions that had to wait */
+	atomic64_t wait_ns;
+	atomic64_t max_wait_ns;
+	atomic64_t hold_ns;
+	atomic64_t max_hold_ns;
+};
+
+/**
+* lock_hold - Current holder of a profiled mutex
+*/
+struct lock_hold {
+	int site;                       /* Index in lock_stats */
+	u64 since;                      /* ktime_get_ns() at acquisition */
+};
+#endif
+
 /**
 * message_struct - Message stored in an instance of the device file
 */
 struct message_struct {
-	unsigned int size;
-	char *buf;
+	unsigned int size;              /* Stored bytes, accounted in current_size */
+	unsigned int raw_size;          /* Payload bytes, differ if compressed */
+	char *buf;                      /* NULL if the payload is pinned */
+	struct zerocopy_struct *zc;     /* Pinned writer pages, if any */
+	unsigned long offset;           /* Position in the log of the device file */
+	unsigned long ttl;              /* Time to live in jiffies, 0 means forever */
+	unsigned long expires;          /* Expiration time, valid if ttl is set */
+	ktime_t posted;                 /* When the message was stored */
+	ktime_t scheduled;              /* When a delayed write was requested */
+	int keyed;                      /* Set if the key is valid */
+	unsigned long long key;
+	struct hlist_node key_node;     /* Linked in conflating mode only */
+	unsigned int tag;
+	struct list_head tag_list;      /* Linked to the sublist of its tag */
+	unsigned long tag_seq;          /* Messages of its tag retained before */
+	unsigned int partition;         /* Hash of the key */
+	struct list_head partition_list; /* Linked in partitioned mode only */
+	int reply;                      /* Routed to the CALL with corr_id */
+	unsigned long long corr_id;
 	struct list_head list;
+	struct list_head expiry;        /* Linked only if ttl is set */
+};
+
+/**
+* zerocopy_struct - Writer pages referenced by a message (zerocopy writes)
+*/
+struct zerocopy_struct {
+	struct page **pages;
+	unsigned int nr_pages;
+	unsigned int first_offset;      /* Offset of the payload in pages[0] */
+	unsigned long long cookie;      /* User address of the payload */
+	int status;                     /* Reported in the completion */
+	struct session_struct *session; /* Writer, NULL once released */
+	struct list_head list;          /* Linked to the zerocopy list of session */
 };
 
 /**
@@ -34,11 +363,63 @@ struct message_struct {
 */
 struct minor_struct {
 	unsigned int current_size;
+	unsigned int msg_count;         /* Messages stored in the device file,
+					   also read without locking */
+	unsigned int mode;              /* MINOR_MODE_* flags */
+	int node;                       /* NUMA node of messages (SET_MINOR_NODE) */
+	unsigned int overflow_policy;   /* OVERFLOW_* */
+	unsigned long next_offset;      /* Offset of the next posted message */
 	struct mutex mtx;
+#ifdef TIMED_MSG_LOCK_STATS
+	struct lock_hold mtx_hold;
+	struct lock_stat lock_stats[LOCK_SITES]; /* Of minor and session mutexes */
+#endif
 	struct list_head fifo;          /* Messages stored in the device file */
+	struct list_head expiry;        /* Messages with a ttl, by expiration */
+	struct delayed_work sweep_work; /* Removes expired messages */
+	unsigned long expired_on_read;  /* Expired messages met by readers */
+	unsigned long expired_by_sweep; /* Expired messages met by the sweep */
+	unsigned long dropped_oldest;   /* Discarded to make room for new posts */
+	unsigned long dropped_new;      /* Discarded because the file was full */
+	unsigned long rejected_batches; /* Corked batches that did not fit */
+	unsigned long conflated;        /* Replaced by a message with same key */
+	unsigned long compressed;       /* Stored compressed */
+	unsigned long compress_saved;   /* Bytes saved by compression */
+	DECLARE_HASHTABLE(keys, KEY_HASH_BITS); /* Index by key (conflation) */
+	struct list_head tags[MSG_TAGS];        /* Stored messages by tag */
+	unsigned int tag_count[MSG_TAGS];
+	unsigned int tag_bytes[MSG_TAGS];
+	struct list_head partitions[PARTITIONS]; /* Stored messages by partition */
+	unsigned int partition_count[PARTITIONS];
+	unsigned int partition_bytes[PARTITIONS];
+	struct session_struct *partition_owner[PARTITIONS];
+	struct list_head consumers;     /* Sessions owning partitions */
+	unsigned int nr_consumers;
+	DECLARE_HASHTABLE(calls, CALL_HASH_BITS); /* CALLs waiting a reply */
+	unsigned long orphan_replies;   /* Replies nobody was waiting for */
+	atomic_long_t busy_poll_hits;   /* Spinning readers that found a message */
+	atomic_long_t busy_poll_misses; /* Spinning readers that went to sleep */
+	unsigned long latency_hist[LATENCY_BUCKETS]; /* Queueing delays (ns) */
+	struct xarray log;              /* Retained messages indexed by offset */
+	struct xarray tag_log[MSG_TAGS]; /* The same, per tag */
+	unsigned long tag_posted[MSG_TAGS]; /* Messages of a tag ever retained */
+	struct list_head groups;        /* Consumer groups (retained mode) */
 	struct list_head sessions;
-	struct list_head pending_reads; 
+	struct list_head restored_writes; /* Delayed posts of a snapshot */
+	struct fasync_struct *fasync;   /* SIGIO on post (O_ASYNC sessions) */
+	unsigned int eventfds;          /* Sessions with a registered eventfd */
+	struct plist_head pending_reads; /* Blocked readers, by priority */
 	wait_queue_head_t read_wq;      /* Used from blocking readers to wait for messages */
+} ____cacheline_aligned_in_smp;
+
+/**
+* group_struct - Consumer group sharing a read offset in retained mode
+*/
+struct group_struct {
+	char name[GROUP_NAME_LEN];
+	unsigned long offset;           /* Next offset to be read by the group */
+	unsigned int members;           /* Number of sessions joined */
+	struct list_head list;
 };
 
 /**
@@ -46,30 +427,100 @@ struct minor_struct {
 */
 struct pending_write_struct {
 	int minor;
-	struct session_struct *session;
-	char *kbuf;                     /* Points to the message to post */
-	unsigned int len;               /* Size of the message to post */
+	struct session_struct *session; /* NULL if restored from a snapshot */
+	struct message_struct *msg;     /* Message to post */
+	unsigned long long seq;         /* Reported in the completion */
 	struct delayed_work delayed_work;
 	struct list_head list;
 };
 
+/**
+* snapshot_state - An open snapshot file of the debugfs directory of a minor
+*/
+struct snapshot_state {
+	struct minor_struct *minor;
+	char *buf;                      /* Dump (read) or partial record (write) */
+	size_t len;                     /* Valid bytes in buf */
+	size_t size;                    /* Capacity of buf when writing */
+	int loaded_header;              /* Set once the header is applied */
+	unsigned long next_offset;      /* Of the restored header */
+	unsigned long min_offset;       /* Lowest offset of the next record */
+	int error;                      /* Sticky error of the restore */
+};
+
 /**
 * pending_read_struct - A read waiting for available messages
 */
 struct pending_read_struct {
 	int msg_available; /* Set from a writer when a new message is available */
 	int flushing;      /* Set when someone calls dev_flush() */
-	struct list_head list;	
+	struct session_struct *session;
+	struct plist_node list;         /* Ordered by priority, lower first */
+	unsigned long long corr_id;     /* Pending calls only */
+	struct message_struct *reply;   /* Set when the reply is posted */
+	struct hlist_node call_node;    /* Linked to the calls of the minor */
 };
 
 /**
 * session_struct - I/O session auxiliary information
 */
 struct session_struct {
+	int minor;
 	struct mutex mtx;
+#ifdef TIMED_MSG_LOCK_STATS
+	struct lock_hold mtx_hold;
+#endif
 	struct workqueue_struct *write_wq; /* Used to defer writes*/
 	unsigned long write_timeout;       /* 0 means immediate storing */
 	unsigned long read_timeout;        /* 0 means non-blocking reads */
+	unsigned long msg_ttl;             /* 0 means messages never expire */
+	unsigned long offset;              /* Next offset to read (retained mode) */
+	struct group_struct *group;        /* NULL if the session is not grouped */
+	unsigned int lowat_msgs;           /* Messages awaking a blocked reader */
+	unsigned int lowat_bytes;          /* Bytes awaking a blocked reader */
+	unsigned long lowat_latency;       /* Max jiffies a blocked reader waits
+					      for the low watermark */
+	struct timer_list lowat_timer;     /* Enforces lowat_latency */
+	int lowat_expired;                 /* Set when lowat_timer expires */
+	wait_queue_head_t poll_wq;         /* Used from dev_poll() */
+	struct eventfd_ctx *eventfd;       /* Signaled on posts */
+	struct eventfd_ctx *completion_eventfd; /* Signaled on completions */
+	unsigned int busy_poll_us;         /* 0 means no spinning before sleep */
+	unsigned int busy_poll_budget;     /* Current (adaptive) spinning time */
+	int read_header;                   /* Prepend a read_header_struct */
+	int strict_read;                   /* Short buffers fail, not truncate */
+	int write_header;                  /* Expect a write_header_struct */
+	unsigned long long tag_filter;     /* Bit i set if tag i is read */
+	int read_prio;                     /* READ_PRIO_TASK or explicit */
+	int consumer;                      /* Set if partitions can be owned */
+	unsigned int partitions;           /* Bit i set if partition i is owned */
+	unsigned int nr_partitions;
+	struct list_head consumer_list;
+	void *compress_wrkmem;             /* LZ4 working memory */
+	char *compress_buf;                /* LZ4 output */
+	size_t compress_buf_size;
+	int zerocopy;                      /* Pin the pages of written buffers */
+	struct list_head zerocopy_msgs;    /* Messages referencing pinned pages */
+	struct completion_struct completions[COMPLETION_RING];
+	unsigned int completion_head;
+	unsigned int completion_count;
+	unsigned long completions_lost;    /* Since the last GET_COMPLETION */
+	int post_completions;              /* Report deferred write outcomes */
+	unsigned long long deferred_seq;   /* Next deferred write number */
+	struct rate_limit_struct rate_limit;
+	int rate_limited;                  /* Set if a rate is configured */
+	s64 msg_tokens;                    /* Scaled by NSEC_PER_SEC */
+	s64 byte_tokens;                   /* Scaled by NSEC_PER_SEC */
+	ktime_t rate_refill;               /* Last refill of the buckets */
+	struct mutex cork_mtx;             /* Protects the cork_* fields */
+	int corked;                        /* Writes are staged (CORK) */
+	struct cork_struct cork;
+	struct list_head cork_msgs;        /* Staged messages, in write order */
+	unsigned int cork_count;
+	unsigned int cork_bytes;
+	struct delayed_work cork_work;     /* Enforces cork.max_latency */
+	int write_affinity;                /* WRITE_AFFINITY_* */
+	int write_affinity_target;         /* CPU or NUMA node */
 	struct list_head pending_writes;
 	struct list_head list;
 };
@@ -116,7 +567,9 @@ static int dev_release(struct inode *, struct file *);
 * @len: buffer size
 * @offp: unused
 *
-* Returns the number of read bytes on success. Otherwise, it returns:
+* Returns the number of read bytes on success, including the
+* %read_header_struct if requested through %SET_READ_HEADER. Otherwise, it
+* returns:
 * - %-ENOMSG if no message is available and the operating mode of
 *   the I/O session is non-blocking (read timeout equal to 0)
 * - %-ENOMEM if it fails in allocating a %pending_read_struct
@@ -125,10 +578,22 @@ static int dev_release(struct inode *, struct file *);
 *   device file through dev_flush()
 * - %-ETIME if timeout expired
 * - %-EFAULT if the provided buffer is illegal
+* - %-EINVAL if the buffer cannot hold the %read_header_struct, or if the
+*   device file is partitioned and the session is not a consumer
+* - %-EMSGSIZE if the buffer cannot hold the whole message and strict reads
+*   are requested through %SET_STRICT_READ
 *
 * NOTE The message receipt fully invalidates the content of the message to
 *      be delivered, even if the read() operation requests less bytes than
-*      the current size of the message.
+*      the current size of the message, unless strict reads are requested.
+*      In that case the message stays queued and its size can be obtained
+*      through %PEEK_SIZE.
+* NOTE A compressed message is removed before being decompressed out of the
+*      mutex of the device file, so it is lost if the buffer is illegal.
+* NOTE In retained mode the message is not removed: the read offset of the
+*      session (or of its group) is moved past it instead.
+* NOTE In partitioned mode only the messages of the partitions owned by the
+*      session are delivered.
 */
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
 
@@ -140,16 +605,31 @@ static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
  * @offp: unused
  *
  * Returns:
- * - the length of the written message, if the non-blocking mode is set and the
- * - operation succeeds.
+ * - the length of the written message (including the %write_header_struct,
+ *   if requested through %SET_WRITE_HEADER), if the non-blocking mode is set
+ *   and the operation succeeds.
+ * - %EINVAL if the write header is missing or not valid (e.g. the tag is not
+ *   below %MSG_TAGS, or both a delay and a release time are given)
  * - %EMSGSIZE if the message is too long (len > max_message_size)
+ * - %EAGAIN if the rate limit of the session is exceeded and its action is
+ *   %RATE_LIMIT_REJECT, or if the write would owe more than one burst with
+ *   %RATE_LIMIT_DELAY
  * - %ENOMEM if allocation of used kernel buffers fails
  * - %EFAULT if @bufp points to an illegal memory area
- * - %ENOSPC if the device file is temporary full
- * - %0 if a write timeout exists. In that case, the actual write is delayed.
+ * - %ENOSPC if the device file is temporary full and its overflow policy
+ *   is %OVERFLOW_REJECT
+ * - %0 if a write timeout exists, the write header carries a delay or a
+ *   release time in the future, or the post is delayed by the rate limit of
+ *   the session. In that case, the actual write is delayed.
  *
  * NOTE that when the write is delayed, it may fail in the absence of free
- * space in the device file. 
+ * space in the device file. The outcome is reported as a %COMPLETION_POST
+ * completion if the session enabled %SET_POST_COMPLETIONS
+ * NOTE In a corked session an immediate write only stages the message, and
+ * the length is returned. If the write hits a bound of the cork, the whole
+ * batch is published and the error of the publication, if any, is returned.
+ * A message that would take the batch past max_bytes is staged after the
+ * batch is published, and is discarded if the publication fails
  */
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
 
@@ -157,18 +637,104 @@ static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
 * dev_ioctl - modify the operating mode of read() and write()
 * @filep: pointer to struct file
 * @cmd: one of the macro defined in timed-msg-system.h (%SET_SEND_TIMEOUT,
-* %SET_RECV_TIMEOUT, %REVOKE_DELAYED_MESSAGES)
-* @arg: read/write timeout (optional)
+* %SET_RECV_TIMEOUT, %REVOKE_DELAYED_MESSAGES, %SET_MINOR_MODE, %SEEK_OFFSET,
+* %GET_OFFSET, %JOIN_GROUP, %LEAVE_GROUP, %SET_MSG_TTL, %SET_RCVLOWAT,
+* %SET_BUSY_POLL_US, %SET_WRITE_AFFINITY, %SET_MINOR_NODE, %SET_READ_HEADER,
+* %SET_OVERFLOW_POLICY, %SET_WRITE_HEADER, %SET_ZEROCOPY, %GET_COMPLETION,
+* %SET_TAG_FILTER, %CALL, %SET_CONSUMER, %SET_RATE_LIMIT, %SET_READ_PRIORITY,
+* %SET_POST_COMPLETIONS, %CORK, %UNCORK, %DELETE_GROUP,
+* %REGISTER_COMPLETION_EVENTFD)
+* @arg: read/write timeout, time to live, mode, offset or user pointer
+*       (optional)
 *
 * Returns:
 * - 0 if the operation succeeds
 * - %ENOTTY if the provided command is not valid
+* - %EINVAL if the argument is not valid for the command or the device file
+*   is not in retained mode when an offset command is used
+* - %EBUSY if retained, conflating or partitioned mode is requested while
+*   messages are stored, or if sessions are still joined to the group to
+*   delete
+* - %EFAULT if @arg points to an illegal memory area
+* - %ENAMETOOLONG if the group name does not fit %GROUP_NAME_LEN
+* - %ENOSPC if %MAX_GROUPS groups already exist on the device file
+* - %ENOENT if the group to delete does not exist
+* - %ENOMEM if it fails in allocating a %group_struct
+* - %ENOMSG if no completion is queued to the session
+* - %EOVERFLOW if no completion is queued but some were lost since the
+*   previous %GET_COMPLETION, because the session queue was full
+* - %ENOSPC if the batch published by %UNCORK does not fit the device file
+* - %ETIME if the reply of a %CALL did not arrive in time, %ECANCELED if
+*   dev_flush() is called on the reply minor while waiting, %EMSGSIZE if
+*   the request is too long, or any error of dev_write() posting it
 *
 * If %SET_SEND_TIMEOUT is provided, the write timeout of the current session
 * is set to the value @arg.
 * If %SET_RECV_TIMEOUT is provided, the read timeout of the current session
 * is set to the value @arg.
 * If %REVOKE_DELAYED_MESSAGES is provided, the pending writes are undone.
+* If %SET_MINOR_MODE is provided, the device file mode is set to @arg
+* (%MINOR_MODE_* flags).
+* If %SEEK_OFFSET is provided, the read offset of the session (or of its
+* group) is moved to @arg, clamped to the retained range.
+* If %GET_OFFSET is provided, the read offset is stored at the user address
+* @arg.
+* If %SET_MSG_TTL is provided, the messages written along the current session
+* expire @arg milliseconds after being stored into the device file.
+* If %SET_RCVLOWAT is provided, the low watermark of the session is set to
+* the %rcvlowat_struct at the user address @arg.
+* If %SET_BUSY_POLL_US is provided, blocking reads of the session spin up to
+* @arg microseconds (at most %BUSY_POLL_MAX_US) before going to sleep.
+* If %SET_WRITE_AFFINITY is provided, the deferred writes of the session run
+* according to the %write_affinity_struct at the user address @arg.
+* If %SET_MINOR_NODE is provided, the messages of the device file are
+* allocated on the NUMA node @arg (-1 means no preference).
+* If %SET_READ_HEADER is provided with a non-zero @arg, messages read along
+* the session are prepended by a %read_header_struct.
+* If %SET_OVERFLOW_POLICY is provided, the overflow policy of the device
+* file is set to @arg (%OVERFLOW_*).
+* If %SET_WRITE_HEADER is provided with a non-zero @arg, messages written
+* along the session must be prepended by a %write_header_struct.
+* If %SET_ZEROCOPY is provided with a non-zero @arg, the pages of the buffers
+* written along the session are pinned and referenced by the messages instead
+* of being copied. Once a message is gone, its pages are released and a
+* %COMPLETION_ZEROCOPY completion is queued to the session.
+* If %GET_COMPLETION is provided, the oldest completion queued to the session
+* is stored at the %completion_struct pointed by @arg.
+* If %REGISTER_COMPLETION_EVENTFD is provided, the eventfd whose file
+* descriptor is @arg (-1 unregisters it) is signaled by every completion
+* queued to the session, apart from the eventfd of %REGISTER_EVENTFD.
+* If %SET_TAG_FILTER is provided, the session only reads the messages whose
+* tag bit is set in the mask at the user address @arg (0 is not valid).
+* The filter does not apply in partitioned mode.
+* If %CALL is provided, the request described by the %call_struct at the
+* user address @arg is posted to the device file, with a new correlation ID,
+* and the caller sleeps until a reply with that ID is posted to the reply
+* minor. On success, the size of the reply copied to the reply buffer
+* (including the %read_header_struct, if requested) is returned.
+* If %SET_CONSUMER is provided with a non-zero @arg, the session takes part
+* in the ownership of the partitions of the device file, otherwise it gives
+* its partitions up. The partitions are rebalanced among the consumers.
+* If %SET_RATE_LIMIT is provided, the writes of the session are limited by
+* the token buckets described by the %rate_limit_struct at the user address
+* @arg. The buckets start full.
+* If %SET_READ_PRIORITY is provided, the readers blocked along the session
+* are served with priority @arg (lower first, below %READ_PRIO_LEVELS) or,
+* if @arg is %READ_PRIO_TASK, with the priority of their task.
+* If %SET_POST_COMPLETIONS is provided with a non-zero @arg, a
+* %COMPLETION_POST completion is queued to the session whenever one of its
+* deferred writes is posted, fails or is revoked. The cookie is the sequence
+* number of the write among the deferred writes of the session, from 0.
+* If %CORK is provided, the immediate writes of the session are staged in
+* the session, according to the %cork_struct at the user address @arg, until
+* %UNCORK is provided or a bound is hit. The staged batch is then published
+* to the device file at once, and %UNCORK returns the number of messages
+* stored. A batch discarded when published by the latency bound is reported
+* as a %COMPLETION_BATCH completion.
+* If %JOIN_GROUP is provided, the session joins the group named by the string
+* at the user address @arg, creating it if needed. %LEAVE_GROUP undoes it.
+* If %DELETE_GROUP is provided, the group named by the string at the user
+* address @arg is freed, with its offset, if no session is joined to it.
 *
 * NOTE @arg is interpreted as milliseconds and the granularity of the actual
 * timeout is the one of jiffies. Therefore, according to the value of HZ,
@@ -176,6 +742,33 @@ static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
 */
 static long dev_ioctl(struct file *, unsigned int, unsigned long);
 
+/**
+* dev_poll - Check if a message can be read from the device file
+*
+* @filep: pointer to %struct file representing the I/O session
+* @wait: poll table
+*
+* Returns %EPOLLIN if the low watermark of the session is reached, or if a
+* message is available and the max latency of the session expired. Since
+* write() never blocks, %EPOLLOUT is always returned. %EPOLLPRI is returned
+* while completions are queued to the session
+*/
+static __poll_t dev_poll(struct file *, poll_table *);
+
+/**
+* dev_fasync - Enable or disable the SIGIO notification of a session
+*
+* @fd: file descriptor
+* @filep: pointer to %struct file representing the I/O session
+* @on: set to enable the notification
+*
+* Returns the outcome of fasync_helper()
+*
+* NOTE The owner of the file (F_SETOWN) gets SIGIO, with %POLL_IN, once per
+* batch of messages posted to the device file
+*/
+static int dev_fasync(int, struct file *, int);
+
 /**
 * dev_flush - Reset the state of the device file
 * 